@@ -2,22 +2,39 @@
  * @file dec_client.c
  * @brief Client program that connects to the enc_server and sends a plaintext and key to be decrypted.
  *
- * This program connects to the enc_server on a specified port and sends a plaintext and key to be decrypted. The plaintext and key are read from two separate files whose paths are passed as command line arguments. The program validates that the server it is connected to is the dec_server before sending data.
+ * This program connects to the enc_server on a specified port and sends a plaintext and key to be decrypted. The plaintext and key are read from two separate files whose paths are passed as command line arguments, and are sent straight from the page cache with sendfile() so large inputs are never copied into user space. The program validates that the server it is connected to is the dec_server before sending data.
  *
  * @author: Nils Streedain
  * @date [3/3/2023]
 */
+#include <errno.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define BUFFER_SIZE 1000
+#define STREAM_FRAME -1
+#define STREAM_CHUNK (1 << 16)
+#define STRIPE_ALIGN 4096
+#define MANIFEST_CONNECTIONS 4
+#define BUSY_HELLO "bsy"
+#define FRAME_BUSY -2
+#define BUSY_RETRIES 8
+#define BUSY_BACKOFF_US 10000
 
 /**
  * @brief Reports an error message to the standard error output and exits the program.
@@ -43,6 +60,26 @@ int error(int exitCode, const char *format, ...) {
 	exit(exitCode);
 }
 
+/**
+ * @brief Reports an error message to the standard error output without exiting the program.
+ *
+ * Used where an error only affects one piece of work, such as a single file in a manifest, and the rest should carry on.
+ *
+ * @param format The format string for the error message.
+ * @param ... Additional arguments to be included in the error message.
+ */
+void warning(const char *format, ...) {
+	// Retrieve additional arguments
+	va_list args;
+	va_start(args, format);
+	
+	// Print error to stderr
+	fprintf(stderr, "Client error: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
 /**
  * @brief Sets up a sockaddr_in struct with the given port number and hostname.
  *
@@ -74,7 +111,7 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber, char* hostn
 /**
  * @brief Sends data over a socket in multiple smaller chunks to prevent exceeding the buffer size.
  *
- * First, the function sends the length of the data as an integer, then it sends the data in smaller chunks of size BUFFER_SIZE or less. If an error occurs during sending, the function will exit with an error code of 1.
+ * First, the function sends the length of the data as an integer, then it sends the data in smaller chunks of size BUFFER_SIZE or less. Every send but the last is flagged MSG_MORE, so the header and chunks go out as full segments instead of small ones held back by Nagle's algorithm. If an error occurs during sending, the function will exit with an error code of 1.
  *
  * @param sock The socket to send data over
  * @param data The data to send
@@ -84,7 +121,7 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber, char* hostn
 void sendData(int sock, char* data) {
 	// Get length of data
 	int len = (int)strlen(data);
-	if (send(sock, &len, sizeof(len), 0) < 0)
+	if (send(sock, &len, sizeof(len), len ? MSG_MORE : 0) < 0)
 		error(1, "Unable to write to socket");
 	
 	// Loop over send() for len amount of data
@@ -92,7 +129,7 @@ void sendData(int sock, char* data) {
 	for (int i = 0; i < len; i += charsSent) {
 		int remaining = len - i;
 		charsSent = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
-		if (send(sock, data + i, charsSent, 0) < 0)
+		if (send(sock, data + i, charsSent, remaining > charsSent ? MSG_MORE : 0) < 0)
 			error(1, "Unable to write to socket");
 	}
 }
@@ -100,7 +137,7 @@ void sendData(int sock, char* data) {
 /**
  * @brief Receives data over a socket in multiple smaller chunks to prevent exceeding the buffer size.
  *
- * First, the function receives the length of the data as an integer, then it receives the data in smaller chunks of size BUFFER_SIZE - 1 or less. If an error occurs during receiving or memory allocation, the function will exit with an error code of 1.
+ * First, the function receives the length of the data as an integer, then it receives the data in smaller chunks of size BUFFER_SIZE - 1 or less. If an error occurs during receiving or memory allocation, or the server sends FRAME_BUSY in place of a length because it had no memory to spare for the request, the function will exit with an error code of 1.
  *
  * @param sock The socket to receive data from
  * @return A pointer to a string of received data. The string must be freed by the caller when no longer needed.
@@ -110,8 +147,12 @@ void sendData(int sock, char* data) {
 char* receive(int sock) {
 	// Get length of data
 	int len;
-	if (recv(sock, &len, sizeof(len), 0) < 0)
+	if (recv(sock, &len, sizeof(len), MSG_WAITALL) != sizeof(len))
 		error(1, "Unable to read from socket");
+	if (len == FRAME_BUSY)
+		error(1, "Server out of memory for this request, try again later");
+	if (len < 0)
+		error(1, "Invalid frame length: %d", len);
 	
 	// Init output
 	char* result = malloc(len + 1);
@@ -123,7 +164,7 @@ char* receive(int sock) {
 	for (int i = 0; i < len; i += charsRead) {
 		int size = len - i > BUFFER_SIZE - 1 ? BUFFER_SIZE - 1 : len - i;
 		charsRead = (int)recv(sock, result + i, size, 0);
-		if (charsRead < 0)
+		if (charsRead <= 0)
 			error(1, "Unable to read from socket");
 	}
 	
@@ -131,85 +172,672 @@ char* receive(int sock) {
 	return result;
 }
 
+/**
+ * @brief Receives a result that must be exactly as long as the text that was sent.
+ *
+ * The caller copies or writes len characters of the result, so a short or long frame from the server would read past the end of the buffer or leave part of the output unset. Such a frame is treated like any other protocol failure, and the function will exit with an error code of 1.
+ *
+ * @param sock The socket to receive data from
+ * @param len The number of characters the result must have
+ * @return A pointer to a string of exactly len received characters. The string must be freed by the caller when no longer needed.
+*/
+char* receiveExact(int sock, size_t len) {
+	char* result = receive(sock);
+	size_t got = strlen(result);
+	if (got != len)
+		error(1, "Server returned %zu characters, expected %zu", got, len);
+	return result;
+}
+
 /**
  * @brief Validates whether the given socket is connected to a dec_server.
  *
- * Sends a "dec" message to the socket and receiving a response from the server. If the response is not "dec", the function will close the socket and exit with an error code of 2.
+ * Sends a "dec" message to the socket and receiving a response from the server. If the server is at its concurrency limit it answers BUSY_HELLO instead, and the socket is closed so the caller can try again. A busy server closes the connection straight after answering, and a hello that arrives after that makes the connection reset, which can discard BUSY_HELLO before it is read, so a reset before any reply has arrived is taken as busy too. Any reply that did arrive is checked as usual, so other failures are still reported as they are. If the response is anything else but "dec", the function will close the socket and exit with an error code of 2.
  *
  * @param sock The socket to validate
+ * @return 0 if the server accepted the connection, or -1 if it was busy
  * @pre The socket is connected and able to send/receive data
  * @post The socket will be closed if the server's response is not "dec"
 */
-void validate(int sock) {
+int validate(int sock) {
 	// Init client/server validation vars
 	char client[4] = "dec", server[4];
 	memset(server, '\0', sizeof(server));
 	
-	// Send validation to server
-	if (send(sock, client, sizeof(client), 0) < 0)
-		error(1, "Unable to write to socket");
+	// Send validation to server, a reply may still be waiting if the server has already reset the connection
+	int reset = 0;
+	if (send(sock, client, sizeof(client), MSG_NOSIGNAL) < 0) {
+		if (errno != ECONNRESET && errno != EPIPE)
+			error(1, "Unable to write to socket");
+		reset = 1;
+	}
 	
 	// Recieve validation from server
-	if (recv(sock, server, sizeof(server), 0) < 0)
-		error(1, "Unable to read from socket");
+	ssize_t got = recv(sock, server, sizeof(server), MSG_WAITALL);
+	if (got < 0) {
+		if (errno != ECONNRESET)
+			error(1, "Unable to read from socket");
+		reset = 1;
+	}
 	
 	// Check server validation
+	if ((got <= 0 && reset) || !strcmp(server, BUSY_HELLO)) {
+		close(sock);
+		return -1;
+	}
 	if (strcmp(client, server)) {
 		close(sock);
 		error(2, "Server not dec_server");
 	}
+	return 0;
 }
 
 /**
- * @brief Reads the contents of a file located at the given path and returns the contents as a string.
+ * @brief Hands a file range to sendfile() so the kernel moves the bytes straight from the page cache into the socket.
  *
- * This function opens the file located at the given path in read-only mode, and reads its contents into a dynamically allocated buffer. If an error occurs while opening or reading the file, NULL is returned. Otherwise, the buffer containing the file contents is returned, and it is the caller's responsibility to free this memory when it is no longer needed.
+ * sendfile() may transfer less than asked for, so it is looped until the whole range has been sent.
  *
- * The file is assumed to contain only capital letters and spaces. If an invalid character is found in the file, the function will print an error message and return NULL. The error message will indicate the file path, the invalid character, and its ASCII code.
+ * @param sock The socket to send data over
+ * @param fd An open file descriptor for the file to send from
+ * @param offset The offset within the file of the first byte to send
+ * @param len The number of bytes to send
+ * @return 0 once the whole range has been sent, or -1 on error
+*/
+int sendFileData(int sock, int fd, off_t offset, size_t len) {
+	while (len > 0) {
+		ssize_t charsSent = sendfile(sock, fd, &offset, len);
+		if (charsSent <= 0)
+			return -1;
+		len -= charsSent;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sends the contents of a file over a socket without copying them through user space.
+ *
+ * First, the function sends the length as an integer, matching the framing used by sendData(), flagged MSG_MORE so it leaves in the same segment as the start of the data. Then sendFileData() sends the file range. If an error occurs during sending, the function will exit with an error code of 1.
+ *
+ * @param sock The socket to send data over
+ * @param fd An open file descriptor for the file to send from
+ * @param offset The offset within the file of the first byte to send
+ * @param len The number of bytes to send
+ * @pre The socket is connected and able to send data
+ * @post len bytes of the file starting at offset will have been sent over the socket
+*/
+void sendFile(int sock, int fd, off_t offset, size_t len) {
+	// Send length of data first, same as sendData()
+	int frameLen = (int)len;
+	if (send(sock, &frameLen, sizeof(frameLen), len ? MSG_MORE : 0) < 0)
+		error(1, "Unable to write to socket");
+	if (sendFileData(sock, fd, offset, len) < 0)
+		error(1, "Unable to write to socket");
+}
+
+/**
+ * @brief Opens the file located at the given path and validates its contents in place.
+ *
+ * This function opens the file in read-only mode and maps it into memory, so the contents can be checked straight out of the page cache rather than being copied into a heap buffer. The mapping is released once validation is done, and the open file descriptor is handed back so the caller can transmit the file with sendFile(). A single trailing newline is not counted as part of the contents.
+ *
+ * The file is assumed to contain only capital letters and spaces. If the file cannot be read or an invalid character is found, the function will print an error message and return -1 with no file left open. The error message will indicate the file path, the invalid character, and its ASCII code.
  *
  * @param path A null-terminated string representing the path to the file to be read.
- * @return A pointer to a null-terminated string containing the contents of the file, or NULL on error.
+ * @param fd Set to an open file descriptor for the file, which the caller must close.
+ * @param len Set to the number of characters in the file, excluding the trailing newline.
+ * @return 0 if the file is valid, or -1 on error.
  */
-char* stringFromFile(char* path) {
+int scanFile(char* path, int* fd, size_t* len) {
 	// Open file at path
+	*fd = open(path, O_RDONLY);
+	if (*fd < 0) {
+		warning("Unable to open file: %s", path);
+		return -1;
+	}
+	
+	// Stat file to get size (len)
+	struct stat info;
+	if (fstat(*fd, &info) < 0) {
+		warning("Unable to open file: %s", path);
+		close(*fd);
+		return -1;
+	}
+	*len = info.st_size;
+	if (!*len)
+		return 0;
+	
+	// Map file contents, reading them front to back
+	char* contents = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, *fd, 0);
+	if (contents == MAP_FAILED) {
+		warning("Unable to map file: %s", path);
+		close(*fd);
+		return -1;
+	}
+	madvise(contents, *len, MADV_SEQUENTIAL);
+	
+	// Strip the trailing newline
+	if (contents[*len - 1] == '\n')
+		(*len)--;
+	
+	// Error if invalid char found
+	for (size_t i = 0; i < *len; i++) {
+		char c = contents[i];
+		if ((c < 'A' || c > 'Z') && c != ' ') {
+			munmap(contents, info.st_size);
+			close(*fd);
+			warning("Invalid character found in file %s: %c, %d", path, c, c);
+			return -1;
+		}
+	}
+	
+	// Unmap file & return
+	munmap(contents, info.st_size);
+	return 0;
+}
+
+/**
+ * @brief Opens and validates the file located at the given path, exiting the program if it is unusable.
+ *
+ * @param path A null-terminated string representing the path to the file to be read.
+ * @param fd Set to an open file descriptor for the file, which the caller must close.
+ * @return The number of characters in the file, excluding the trailing newline.
+ */
+size_t validateFile(char* path, int* fd) {
+	size_t len;
+	if (scanFile(path, fd, &len) < 0)
+		exit(0);
+	return len;
+}
+
+/**
+ * @brief Writes len bytes of data to a file descriptor, looping over short writes.
+ *
+ * @param fd The file descriptor to write to
+ * @param data The data to write
+ * @param len The number of bytes to write
+*/
+void writeAll(int fd, const char* data, size_t len) {
+	while (len > 0) {
+		ssize_t charsWritten = write(fd, data, len);
+		if (charsWritten < 0)
+			error(1, "Unable to write output");
+		data += charsWritten;
+		len -= charsWritten;
+	}
+}
+
+/**
+ * @brief Opens a connection to the server on localhost at the given port and validates it.
+ *
+ * While the server reports it is busy, the connection is retried up to BUSY_RETRIES times, waiting twice as long each time from BUSY_BACKOFF_US with random jitter, so clients turned away together do not all come back together.
+ *
+ * @param port The port number to connect to
+ * @return A connected socket that has passed validate()
+*/
+int connectServer(int port) {
+	// Set up the address struct for the server socket
+	struct sockaddr_in server;
+	setupAddressStruct(&server, port, "localhost");
+	unsigned int seed = (unsigned int)getpid() ^ (unsigned int)pthread_self();
+	
+	for (int attempt = 0; attempt <= BUSY_RETRIES; attempt++) {
+		// Back off before each retry
+		if (attempt) {
+			useconds_t backoff = BUSY_BACKOFF_US << (attempt - 1);
+			usleep(backoff / 2 + rand_r(&seed) % backoff);
+		}
+	
+		// Create the socket that will connect to the server, with frames sent as soon as they are complete
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock < 0)
+			error(0, "Unable to open socket");
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	
+		// Connect to server & validate connection
+		if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0)
+			error(0, "Unable to connect to server");
+		if (!validate(sock))
+			return sock;
+	}
+	error(1, "Server busy, gave up after %d retries", BUSY_RETRIES);
+	return -1;
+}
+
+/**
+ * @brief Sends a whole request without waiting for the server's validation reply, over TCP Fast Open where the kernel allows it.
+ *
+ * The hello and the text length go out with sendto() and MSG_FASTOPEN, which carries them in the SYN once the client holds a Fast Open cookie for the server, and otherwise sends them straight after an ordinary handshake. The text and key follow at once, and only then is the server's reply read and checked, so the request skips the round trip of validate(), and the handshake's too with a cookie. A server of the wrong kind still exits with an error code of 2, after the fact. A busy server is retried as in connectServer(), resending the request from the files. Since the whole request is sent before the reply is read, a busy server has usually closed with part of it unread, which resets the connection and can discard BUSY_HELLO, so a connection reset before any reply has arrived is retried as busy. A reply that did arrive is checked as usual, so a server that reset the connection for any other reason still has its failure reported. Where the kernel has client-side Fast Open turned off, the request is sent the same way over a plain connect().
+ *
+ * @param port The port number to connect to
+ * @param textFd An open file descriptor for the text file
+ * @param keyFd An open file descriptor for the key file
+ * @param len The number of characters in the text
+ * @return A socket with the request sent and the reply validated, ready to receive the result
+*/
+int connectFast(int port, int textFd, int keyFd, size_t len) {
+	// Set up the address struct for the server socket
+	struct sockaddr_in server;
+	setupAddressStruct(&server, port, "localhost");
+	unsigned int seed = (unsigned int)getpid();
+	
+	for (int attempt = 0; attempt <= BUSY_RETRIES; attempt++) {
+		// Back off before each retry
+		if (attempt) {
+			useconds_t backoff = BUSY_BACKOFF_US << (attempt - 1);
+			usleep(backoff / 2 + rand_r(&seed) % backoff);
+		}
+	
+		// Create the socket that will connect to the server
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock < 0)
+			error(0, "Unable to open socket");
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	
+		// Send hello & text length with the SYN
+		struct {
+			char hello[4];
+			int len;
+		} head = {"dec", (int)len};
+		ssize_t sent = sendto(sock, &head, sizeof(head), MSG_FASTOPEN, (struct sockaddr*)&server, sizeof(server));
+		if (sent < 0 && errno == EOPNOTSUPP) {
+			if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0)
+				error(0, "Unable to connect to server");
+			sent = send(sock, &head, sizeof(head), 0);
+		}
+		if (sent < 0 && (errno == ECONNREFUSED || errno == ENETUNREACH))
+			error(0, "Unable to connect to server");
+	
+		// Send text & key without waiting for the reply
+		int keyLen = (int)len;
+		int failed = sent != sizeof(head) || sendFileData(sock, textFd, 0, len) < 0
+			|| send(sock, &keyLen, sizeof(keyLen), len ? MSG_MORE : 0) < 0 || sendFileData(sock, keyFd, 0, len) < 0;
+		int reset = failed && (errno == ECONNRESET || errno == EPIPE);
+	
+		// Check the reply now, the server may have turned the request away
+		char reply[4];
+		memset(reply, '\0', sizeof(reply));
+		ssize_t got = recv(sock, reply, sizeof(reply), MSG_WAITALL);
+		if (got < 0 && errno == ECONNRESET)
+			reset = 1;
+		if (got <= 0 && reset) {
+			close(sock);
+			continue;
+		}
+		if (got < (ssize_t)sizeof(reply))
+			error(1, "Unable to read from socket");
+		if (!strcmp(reply, BUSY_HELLO)) {
+			close(sock);
+			continue;
+		}
+		if (strcmp(reply, head.hello)) {
+			close(sock);
+			error(2, "Server not dec_server");
+		}
+		if (failed)
+			error(1, "Unable to write to socket");
+		return sock;
+	}
+	error(1, "Server busy, gave up after %d retries", BUSY_RETRIES);
+	return -1;
+}
+
+/**
+ * @brief One range of the text and key handled over its own connection by sendStripe().
+*/
+struct stripe {
+	int port;
+	int textFd;
+	int keyFd;
+	off_t offset;
+	size_t len;
+	char* result;
+};
+
+/**
+ * @brief Sends one stripe of the text and key over a new connection and copies the result into place.
+ *
+ * Runs on its own thread, so any error exits the whole client exactly as it would for a single connection.
+ *
+ * @param arg A pointer to the stripe to send
+ * @return NULL
+*/
+void* sendStripe(void* arg) {
+	struct stripe* stripe = arg;
+	int sock = connectServer(stripe->port);
+	sendFile(sock, stripe->textFd, stripe->offset, stripe->len);
+	sendFile(sock, stripe->keyFd, stripe->offset, stripe->len);
+	char* result = receiveExact(sock, stripe->len);
+	memcpy(stripe->result + stripe->offset, result, stripe->len);
+	free(result);
+	close(sock);
+	return NULL;
+}
+
+/**
+ * @brief Splits the text and key into ranges and sends them over concurrent connections.
+ *
+ * Each server connection is handled by a single child process, so a large file only keeps one server core busy. This function cuts the text into up to count ranges aligned to STRIPE_ALIGN, so each sendfile() starts on a page boundary, and sends every range with the matching range of the key over its own connection from its own thread. The decrypted ranges are copied into their place in a single result buffer, which is written to standard output once all stripes are done.
+ *
+ * @param textFd An open file descriptor for the text file
+ * @param keyFd An open file descriptor for the key file
+ * @param len The number of characters in the text
+ * @param port The port number to connect to
+ * @param count The number of stripes to split the text into
+*/
+void sendStripes(int textFd, int keyFd, size_t len, int port, int count) {
+	// Size stripes to cover the text in count aligned pieces
+	size_t stripeLen = (len + count - 1) / count;
+	stripeLen = (stripeLen + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+	
+	// Init result & stripe vars
+	char* result = (char*) malloc(len + 1);
+	struct stripe* stripes = calloc(count, sizeof(*stripes));
+	pthread_t* threads = calloc(count, sizeof(*threads));
+	if (!result || !stripes || !threads)
+		error(0, "Unable to allocate memory");
+	
+	// Start a thread per non-empty stripe
+	int started = 0;
+	for (size_t offset = 0; offset < len; offset += stripeLen, started++) {
+		struct stripe* stripe = &stripes[started];
+		stripe->port = port;
+		stripe->textFd = textFd;
+		stripe->keyFd = keyFd;
+		stripe->offset = offset;
+		stripe->len = len - offset < stripeLen ? len - offset : stripeLen;
+		stripe->result = result;
+		if (pthread_create(&threads[started], NULL, sendStripe, stripe))
+			error(0, "Unable to start stripe thread");
+	}
+	
+	// Wait for all stripes & print the reassembled result
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	result[len] = '\n';
+	writeAll(STDOUT_FILENO, result, len + 1);
+	free(threads);
+	free(stripes);
+	free(result);
+}
+
+/**
+ * @brief One line of a manifest: a text file, the key file and offset to use for it, and where to write the result.
+*/
+struct entry {
+	char* textPath;
+	char* keyPath;
+	off_t keyOffset;
+	char* outPath;
+};
+
+/**
+ * @brief The parsed manifest shared between the connections processing it.
+*/
+struct manifest {
+	struct entry* entries;
+	int count;
+	int next;
+	int failed;
+	int port;
+};
+
+/**
+ * @brief Reads a manifest file into a list of entries.
+ *
+ * Each non-blank line that does not start with '#' names a text file, a key file and an output file separated by whitespace. The key may be followed by ":offset" to start using it at that character instead of the beginning, so one long key can serve many files.
+ *
+ * @param path The path to the manifest file
+ * @param manifest The manifest to fill in
+*/
+void readManifest(char* path, struct manifest* manifest) {
+	// Open manifest file
 	FILE* file = fopen(path, "r");
 	if (!file)
 		error(0, "Unable to open file: %s", path);
 	
-	// Seek file to get sieze (len)
-	fseek(file, 0, SEEK_END);
-	size_t len = ftell(file) - 1;
-	fseek(file, 0, SEEK_SET);
+	// Parse each line into an entry
+	char* line = NULL;
+	size_t lineSize = 0;
+	int capacity = 0, lineNum = 0;
+	while (getline(&line, &lineSize, file) != -1) {
+		lineNum++;
+		char *textPath, *keyPath, *outPath;
+		char first = '#';
+		sscanf(line, " %c", &first);
+		if (first == '#')
+			continue;
+		if (sscanf(line, "%ms %ms %ms", &textPath, &keyPath, &outPath) != 3)
+			error(0, "Invalid manifest line %d in %s", lineNum, path);
+		
+		// Split off an optional key offset
+		off_t keyOffset = 0;
+		char* colon = strrchr(keyPath, ':');
+		if (colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+			keyOffset = strtoll(colon + 1, NULL, 10);
+			*colon = '\0';
+		}
+		
+		// Grow entry list as needed
+		if (manifest->count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			manifest->entries = realloc(manifest->entries, capacity * sizeof(struct entry));
+			if (!manifest->entries)
+				error(0, "Unable to allocate memory");
+		}
+		manifest->entries[manifest->count++] = (struct entry) {textPath, keyPath, keyOffset, outPath};
+	}
+	free(line);
+	fclose(file);
+}
+
+/**
+ * @brief Sends a single manifest entry over an open stream connection and writes its result.
+ *
+ * Problems with the entry's own files are reported and the entry is skipped, leaving the connection usable for the next one.
+ *
+ * @param sock A validated socket that has already been put into stream mode
+ * @param entry The entry to process
+ * @return 0 on success, or -1 if the entry was skipped
+*/
+int sendEntry(int sock, struct entry* entry) {
+	// Validate text & key
+	int textFd, keyFd;
+	size_t textLen, keyLen;
+	if (scanFile(entry->textPath, &textFd, &textLen) < 0)
+		return -1;
+	if (scanFile(entry->keyPath, &keyFd, &keyLen) < 0) {
+		close(textFd);
+		return -1;
+	}
+	if (entry->keyOffset + textLen > keyLen) {
+		warning("Key shorter than text: %s", entry->textPath);
+		close(textFd);
+		close(keyFd);
+		return -1;
+	}
 	
-	// Create buffer, error of unable
-	char* buffer = (char*) malloc(len + 1);
-	if (!buffer) {
-		fclose(file);
+	// Open output file
+	int outFd = open(entry->outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (outFd < 0) {
+		warning("Unable to open file: %s", entry->outPath);
+		close(textFd);
+		close(keyFd);
+		return -1;
+	}
+	
+	// Send text & key range, write decrypted text out. An empty text would end the stream, so it skips the server.
+	if (textLen) {
+		sendFile(sock, textFd, 0, textLen);
+		sendFile(sock, keyFd, entry->keyOffset, textLen);
+		char* result = receiveExact(sock, textLen);
+		writeAll(outFd, result, textLen);
+		free(result);
+	}
+	writeAll(outFd, "\n", 1);
+	
+	// Close files
+	close(outFd);
+	close(textFd);
+	close(keyFd);
+	return 0;
+}
+
+/**
+ * @brief Thread entry point that processes manifest entries over one persistent connection.
+ *
+ * Entries are claimed one at a time from the shared manifest, so faster connections naturally pick up more of the work.
+ *
+ * @param arg A pointer to the shared manifest
+ * @return NULL
+*/
+void* sendEntries(void* arg) {
+	struct manifest* manifest = arg;
+	
+	// Connect & switch the connection to stream mode
+	int sock = connectServer(manifest->port);
+	int frameLen = STREAM_FRAME;
+	if (send(sock, &frameLen, sizeof(frameLen), MSG_MORE) < 0)
+		error(1, "Unable to write to socket");
+	
+	// Claim & send entries until none are left
+	int i;
+	while ((i = __atomic_fetch_add(&manifest->next, 1, __ATOMIC_RELAXED)) < manifest->count)
+		if (sendEntry(sock, &manifest->entries[i]) < 0)
+			__atomic_store_n(&manifest->failed, 1, __ATOMIC_RELAXED);
+	
+	// Send the empty terminator chunk & close
+	frameLen = 0;
+	if (send(sock, &frameLen, sizeof(frameLen), 0) < 0)
+		error(1, "Unable to write to socket");
+	close(sock);
+	return NULL;
+}
+
+/**
+ * @brief Processes every entry of a manifest over a small pool of persistent connections.
+ *
+ * Rather than paying process startup, connection and validation once per file, up to count connections are opened once, each put into stream mode, and the entries are spread across them. A bad entry is reported and skipped without stopping the rest of the batch.
+ *
+ * @param path The path to the manifest file
+ * @param port The port number to connect to
+ * @param count The number of connections to open
+ * @return 0 if every entry succeeded, or 1 if any were skipped
+*/
+int sendManifest(char* path, int port, int count) {
+	// Read manifest
+	struct manifest manifest = {NULL, 0, 0, 0, port};
+	readManifest(path, &manifest);
+	if (count > manifest.count)
+		count = manifest.count;
+	
+	// Start a thread per connection & wait for them to drain the manifest
+	pthread_t* threads = calloc(count, sizeof(*threads));
+	if (count && !threads)
 		error(0, "Unable to allocate memory");
+	for (int i = 0; i < count; i++)
+		if (pthread_create(&threads[i], NULL, sendEntries, &manifest))
+			error(0, "Unable to start connection thread");
+	for (int i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+	
+	// Free manifest
+	for (int i = 0; i < manifest.count; i++) {
+		free(manifest.entries[i].textPath);
+		free(manifest.entries[i].keyPath);
+		free(manifest.entries[i].outPath);
 	}
+	free(manifest.entries);
+	free(threads);
+	return manifest.failed;
+}
+
+/**
+ * @brief Streams text from standard input through the server to standard output.
+ *
+ * The function tells the server to expect a stream by sending STREAM_FRAME in place of a text length, then reads standard input in chunks of up to STREAM_CHUNK characters. Each chunk is validated, sent along with the next unused range of the key, and the decrypted chunk is written to standard output as soon as it comes back. A zero-length chunk ends the stream. Only one chunk is held at a time, so memory use stays constant however much data is piped through.
+ *
+ * As with files, the input may only contain capital letters and spaces, followed by at most one trailing newline.
+ *
+ * @param sock The socket to stream data over
+ * @param keyFd An open file descriptor for the key file
+ * @param keyLen The number of usable characters in the key file
+ * @pre The socket is connected and validated
+ * @post All of standard input will have been decrypted and written to standard output, followed by a newline
+*/
+void streamStdin(int sock, int keyFd, size_t keyLen) {
+	// Tell the server a stream of chunks follows
+	int frameLen = STREAM_FRAME;
+	if (send(sock, &frameLen, sizeof(frameLen), 0) < 0)
+		error(1, "Unable to write to socket");
 	
-	// Copy file contents to buffer
-	for (int i = 0; i < len; i++) {
-		char c = fgetc(file);
-		// Error if invalid char found
-		if ((c < 'A' || c > 'Z') && c != ' ') {
-			free(buffer);
-			fclose(file);
-			error(0, "Invalid character found in file %s: %c, %d", path, c, c);
+	// Init chunk buffer
+	char* chunk = (char*) malloc(STREAM_CHUNK + 1);
+	if (!chunk)
+		error(0, "Unable to allocate memory");
+	off_t keyOffset = 0;
+	int sawNewline = 0;
+	
+	while (1) {
+		// Fill chunk from stdin, stopping early only at end of input
+		size_t len = 0;
+		while (len < STREAM_CHUNK) {
+			ssize_t charsRead = read(STDIN_FILENO, chunk + len, STREAM_CHUNK - len);
+			if (charsRead < 0)
+				error(0, "Unable to read from stdin");
+			if (!charsRead)
+				break;
+			len += charsRead;
+		}
+		if (!len)
+			break;
+		
+		// Error if anything follows the trailing newline
+		if (sawNewline)
+			error(0, "Invalid character found in stdin: \\n, %d", '\n');
+		
+		// Strip the trailing newline & error if invalid char found
+		for (size_t i = 0; i < len; i++) {
+			char c = chunk[i];
+			if (c == '\n' && i == len - 1) {
+				sawNewline = 1;
+				len--;
+				break;
+			}
+			if ((c < 'A' || c > 'Z') && c != ' ')
+				error(0, "Invalid character found in stdin: %c, %d", c, c);
 		}
-		buffer[i] = c;
+		if (!len)
+			continue;
+		
+		// Error if the key runs out
+		if (keyOffset + len > keyLen)
+			error(0, "Key shorter than text");
+		
+		// Send chunk & matching key range, write result out
+		chunk[len] = '\0';
+		sendData(sock, chunk);
+		sendFile(sock, keyFd, keyOffset, len);
+		keyOffset += len;
+		char* result = receiveExact(sock, len);
+		writeAll(STDOUT_FILENO, result, len);
+		free(result);
 	}
-	buffer[len] = '\0';
 	
-	// Close file & return string
-	fclose(file);
-	return buffer;
+	// Send the empty terminator chunk & finish output
+	frameLen = 0;
+	if (send(sock, &frameLen, sizeof(frameLen), 0) < 0)
+		error(1, "Unable to write to socket");
+	writeAll(STDOUT_FILENO, "\n", 1);
+	free(chunk);
 }
 
 /**
  * @brief The main function for a client that sends data to a server for decryption.
  *
- * The function takes in three arguments as command line arguments: the name of the file containing the text to encrypt, the name of the file containing the decryption key, and the port number to connect to. The function initializes the text and key from their respective files, validates the input, and establishes a socket connection to the server. It then validates the connection, sends the data to the server for decryption, receives the decrypted text, and prints it to standard output.
+ * The function takes in three arguments as command line arguments: the name of the file containing the text to decrypt, the name of the file containing the decryption key, and the port number to connect to. The function initializes the text and key from their respective files, validates the input, and establishes a socket connection to the server. It then validates the connection, sends the data to the server for decryption, receives the decrypted text, and prints it to standard output.
+ *
+ * If the text file is given as "-", the text is instead read from standard input and streamed through the server in chunks by streamStdin(), so the client can sit in a shell pipeline over any amount of data. With --stripes N, the text is split across N concurrent connections by sendStripes(). With --fastopen, a single request is sent by connectFast() without first waiting for the server to validate. With --manifest, the port is the only other argument and every file listed in the manifest is handled by sendManifest() over --connections persistent connections.
  *
  * @param argc The number of arguments passed to the program
  * @param argv An array of strings containing the command line arguments
@@ -218,36 +846,93 @@ char* stringFromFile(char* path) {
  * @post The decrypted text will be printed to standard output, and the connection to the server will be closed
 */
 int main(int argc, char * argv[]) {
-	// Check usage & args
-	if (argc < 4)
-		error(0, "USAGE: %s port\n", argv[0]);
-	
-	// Init and validate text/key
-	char* text = stringFromFile(argv[1]);
-	char* key = stringFromFile(argv[2]);
-	if (strlen(text) > strlen(key))
+	// Parse options
+	static struct option options[] = {
+		{"stripes", required_argument, NULL, 's'},
+		{"manifest", required_argument, NULL, 'm'},
+		{"connections", required_argument, NULL, 'c'},
+		{"fastopen", no_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+	int stripes = 1, connections = MANIFEST_CONNECTIONS, fastOpen = 0, opt;
+	char* manifestPath = NULL;
+	while ((opt = getopt_long(argc, argv, "+", options, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				stripes = atoi(optarg);
+				if (stripes < 1)
+					error(0, "Invalid stripe count: %s", optarg);
+				break;
+			case 'm':
+				manifestPath = optarg;
+				break;
+			case 'c':
+				connections = atoi(optarg);
+				if (connections < 1)
+					error(0, "Invalid connection count: %s", optarg);
+				break;
+			case 'f':
+				fastOpen = 1;
+				break;
+			default:
+				error(0, "USAGE: %s [--stripes N | --fastopen] text|- key port\n       %s --manifest list [--connections N] port\n", argv[0], argv[0]);
+		}
+	}
+	
+	// Manifest batches only need the port
+	if (manifestPath) {
+		if (argc - optind < 1)
+			error(0, "USAGE: %s --manifest list [--connections N] port\n", argv[0]);
+		return sendManifest(manifestPath, atoi(argv[optind]), connections);
+	}
+	
+	// Check usage & args, stripes each open their own connection so cannot also use Fast Open
+	if (argc - optind < 3 || (stripes > 1 && fastOpen))
+		error(0, "USAGE: %s [--stripes N | --fastopen] text|- key port\n", argv[0]);
+	char* textPath = argv[optind];
+	char* keyPath = argv[optind + 1];
+	int port = atoi(argv[optind + 2]);
+	
+	// Init and validate text/key, a text of "-" streams stdin instead
+	int streaming = !strcmp(textPath, "-");
+	int textFd = -1, keyFd;
+	size_t textLen = streaming ? 0 : validateFile(textPath, &textFd);
+	size_t keyLen = validateFile(keyPath, &keyFd);
+	if (textLen > keyLen)
 		error(0, "Key shorter than text");
-
-	// Create the socket that will listen for connections
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock < 0)
-		error(0, "Unable to open socket");
-
-	// Set up the address struct for the server socket
-	struct sockaddr_in server;
-	setupAddressStruct(&server, atoi(argv[3]), "localhost");
-
-	// Connect to server
-	if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0)
-		error(0, "Unable to connect to server");
-
-	// Validate connection, send data & print decrypted text
-	validate(sock);
-	sendData(sock, text);
-	sendData(sock, key);
-	printf("%s\n", receive(sock));
 	
-	// Close the listening socket
+	// Striped requests open their own connections
+	if (stripes > 1 && !streaming) {
+		sendStripes(textFd, keyFd, textLen, port, stripes);
+		close(textFd);
+		close(keyFd);
+		return 0;
+	}
+	
+	// Fast Open sends the request before the server has validated
+	if (fastOpen && !streaming) {
+		signal(SIGPIPE, SIG_IGN);
+		int sock = connectFast(port, textFd, keyFd, textLen);
+		printf("%s\n", receive(sock));
+		close(sock);
+		close(textFd);
+		close(keyFd);
+		return 0;
+	}
+	
+	// Connect to server, send data & print decrypted text
+	int sock = connectServer(port);
+	if (streaming) {
+		streamStdin(sock, keyFd, keyLen);
+	} else {
+		sendFile(sock, textFd, 0, textLen);
+		sendFile(sock, keyFd, 0, textLen);
+		printf("%s\n", receive(sock));
+		close(textFd);
+	}
+	
+	// Close the socket & files
 	close(sock);
+	close(keyFd);
 	return 0;
 }
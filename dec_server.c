@@ -7,18 +7,92 @@
  * @author: Nils Streedain
  * @date [3/3/2023]
 */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "otp_kernel.h"
+#include "otp_stats.h"
+#include "otp_log.h"
+#include "otp_probes.h"
+#include "otp_perf.h"
+#include "otp_budget.h"
+#include "otp_sched.h"
+#include "otp_pool.h"
+#include "otp_affinity.h"
+#include "otp_arena.h"
 
 #define BUFFER_SIZE 1000
+#define STREAM_FRAME -1
+#define BUSY_HELLO "bsy"
+#define FRAME_BUSY -2
+#define STREAM_CHUNK (1 << 16)
+#define BUDGET_WAIT_MS 1000
+#define BUDGET_LARGE_SHARE 4
+#define WORKER_IO_TIMEOUT_S 10
+#define WORKER_REQUEST_TIMEOUT_S 30
+
+// Shared phase statistics, and the trace of the request this child or worker is handling
+struct stats* stats;
+__thread struct trace trace;
+int traceFd = -1;
+
+// Shared access log ring, and the client of the request this child or worker is handling
+struct logRing* accessLog;
+__thread struct sockaddr_in peer;
+volatile sig_atomic_t statsRequested = 0;
+
+// Request children still running, and the most allowed at once (0 for no limit)
+volatile sig_atomic_t children = 0;
+int maxChildren = 0;
+sigset_t childMask;
+
+// The shortest-first scheduler, when enabled with -S, whose connections children must not keep
+struct sched* sched;
+
+// Helper processes this process forked that are not request children: the metrics process, logger & extra acceptors
+pid_t* helpers;
+int helperCount = 0;
+
+// Server-wide memory budget, when enabled with -M, how much of it this child or worker holds, and a request child's holder slot
+struct budget* budget;
+__thread int64_t reserved = 0;
+int budgetSlot = -1;
+
+// Hardware counters around the transform, when enabled with -p, and whether this child or worker has them open
+int perfEnabled = 0;
+__thread int perfReady = 0;
+__thread struct perfCounters perf;
+
+// CPUs this acceptor's children or workers are pinned to in turn, when set with -P, and whether their memory is bound to each CPU's node
+int* cpus;
+int cpuCount = 0;
+int bindMemory = 0;
+
+// In a worker thread, where error() returns to instead of exiting, and when the request must be done by (0 for no deadline)
+__thread jmp_buf* requestJump;
+__thread uint64_t requestDeadline = 0;
+
+// Request buffers of this child or worker, kept mapped between requests until idle for arenaIdleMs
+__thread struct arena arena;
+int arenaIdleMs = ARENA_IDLE_MS;
 
 /**
  * @brief Reports an error message to the standard error output and exits the program.
  *
+ * On a worker thread in threaded mode only the request fails, so instead of exiting, error() jumps back to the worker with the exit code, and the worker cleans up after the request.
+ *
  * @param exitCode The exit code to exit the program with.
  * @param format The format string for the error message.
  * @param ... Additional arguments to be included in the error message.
@@ -35,8 +109,14 @@ int error(int exitCode, const char *format, ...) {
 	vfprintf(stderr, format, args);
 	fprintf(stderr, "\n");
 	
-	// End var arg list & exit
+	// End var arg list, count error & exit
 	va_end(args);
+	if (stats)
+		statsCount(stats, COUNTER_ERRORS, 1);
+	if (accessLog && trace.pid)
+		logRequest(accessLog, &trace, &peer, "dec", exitCode);
+	if (requestJump)
+		longjmp(*requestJump, exitCode ? exitCode : 1);
 	exit(exitCode);
 }
 
@@ -62,10 +142,76 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber){
 	address->sin_addr.s_addr = INADDR_ANY;
 }
 
+/**
+ * @brief Opens a socket listening for connections on the given port.
+ *
+ * With reusePort set, the socket is opened with SO_REUSEPORT so that several acceptor processes can each listen on the same port with a socket of their own, and the kernel spreads new connections across them instead of every acceptor contending for one queue. With fastOpen set, clients holding a TCP Fast Open cookie may carry their first bytes in the SYN, and up to fastOpen such connections may be pending at once.
+ *
+ * @param port The port to listen on
+ * @param backlog The most connections that may wait to be accepted
+ * @param reusePort Nonzero to share the port with other acceptors
+ * @param fastOpen The TCP Fast Open queue length, or 0 to leave Fast Open off
+ * @return The listening socket
+*/
+int openListener(int port, int backlog, int reusePort, int fastOpen) {
+	// Create the socket that will listen for connections
+	int listenSock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenSock < 0)
+		error(1, "Unable to open socket");
+	int on = 1;
+	if (reusePort && setsockopt(listenSock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		error(1, "Unable to share port between acceptors");
+	if (fastOpen && setsockopt(listenSock, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen, sizeof(fastOpen)) < 0)
+		error(1, "Unable to enable TCP Fast Open");
+	
+	// Set up the address struct for the server socket
+	struct sockaddr_in server;
+	setupAddressStruct(&server, port);
+
+	// Associate the socket to the port
+	if (bind(listenSock, (struct sockaddr *) &server, sizeof(server)) < 0)
+		error(1, "Unable to bind socket");
+
+	// Start listening for connetions
+	if (listen(listenSock, backlog) < 0)
+		error(1, "Unable to listen on socket");
+	return listenSock;
+}
+
+/**
+ * @brief Allocates a buffer for the current request from the arena. Buffers are not freed one by one, the arena is reset once the request is done.
+ *
+ * @param size The number of bytes to allocate
+ * @return The buffer
+*/
+void* requestAlloc(size_t size) {
+	void* buffer = arenaAlloc(&arena, size);
+	if (!buffer)
+		error(1, "Unable to allocate memory");
+	return buffer;
+}
+
+/**
+ * @brief Idle hook for worker threads that returns arena memory unused for arenaIdleMs to the OS.
+*/
+void workerIdle(void) {
+	arenaTrim(&arena, arenaIdleMs);
+}
+
+/**
+ * @brief Fails the request if it has run past its deadline.
+ *
+ * Socket timeouts only bound each call, so a client trickling a byte at a time could keep a worker forever. Checking the deadline before every blocking call bounds the whole request, overshooting by at most one call's timeout. Forked children have no deadline.
+*/
+void checkDeadline(void) {
+	if (requestDeadline && now() > requestDeadline)
+		error(1, "Request timed out");
+}
+
 /**
  * @brief Sends data over a socket in multiple smaller chunks to prevent exceeding the buffer size.
  *
- * First, the function sends the length of the data as an integer, then it sends the data in smaller chunks of size BUFFER_SIZE or less. If an error occurs during sending, the function will exit with an error code of 1.
+ * First, the function sends the length of the data as an integer, then it sends the data in smaller chunks of size BUFFER_SIZE or less. Every send but the last is flagged MSG_MORE, so the header and chunks go out as full segments instead of small ones held back by Nagle's algorithm. If an error occurs during sending, the function will exit with an error code of 1.
  *
  * @param sock The socket to send data over
  * @param data The data to send
@@ -75,17 +221,43 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber){
 void sendData(int sock, char* data) {
 	// Get length of data
 	int len = (int)strlen(data);
-	if (send(sock, &len, sizeof(len), 0) < 0)
+	OTP_PROBE2(send_entry, sock, len);
+	checkDeadline();
+	if (send(sock, &len, sizeof(len), len ? MSG_MORE : 0) < 0)
 		error(1, "Unable to write to socket");
+	statsCount(stats, COUNTER_BYTES_OUT, len);
 	
 	// Loop over send() for len amount of data
-	int charsSent;
-	for (int i = 0; i < len; i += charsSent) {
+	int charsSent, calls = 1;
+	for (int i = 0; i < len; i += charsSent, calls++) {
 		int remaining = len - i;
 		charsSent = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
-		if (send(sock, data + i, charsSent, 0) < 0)
+		checkDeadline();
+		if (send(sock, data + i, charsSent, remaining > charsSent ? MSG_MORE : 0) < 0)
 			error(1, "Unable to write to socket");
 	}
+	statsCount(stats, COUNTER_SEND_CALLS, calls);
+	OTP_PROBE2(send_return, sock, len);
+}
+
+/**
+ * @brief Receives exactly len bytes of a frame's data into a buffer, in chunks of size BUFFER_SIZE - 1 or less.
+ *
+ * @param sock The socket to receive data from
+ * @param buffer The buffer to receive into, at least len bytes
+ * @param len The number of bytes to receive
+*/
+void receiveInto(int sock, char* buffer, int len) {
+	// Loop over recv() for len amount of data
+	int charsRead, calls = 0;
+	for (int i = 0; i < len; i += charsRead, calls++) {
+		int size = len - i > BUFFER_SIZE - 1 ? BUFFER_SIZE - 1 : len - i;
+		checkDeadline();
+		charsRead = (int)recv(sock, buffer + i, size, 0);
+		if (charsRead <= 0)
+			error(1, "Unable to read from socket");
+	}
+	statsCount(stats, COUNTER_RECV_CALLS, calls);
 }
 
 /**
@@ -94,92 +266,435 @@ void sendData(int sock, char* data) {
  * First, the function receives the length of the data as an integer, then it receives the data in smaller chunks of size BUFFER_SIZE - 1 or less. If an error occurs during receiving or memory allocation, the function will exit with an error code of 1.
  *
  * @param sock The socket to receive data from
- * @return A pointer to a string of received data. The string must be freed by the caller when no longer needed.
+ * @return A pointer to a string of received data, in the request's arena.
  * @pre The socket is connected and able to receive data
  * @post The entire data will be received over the socket in multiple smaller chunks of size BUFFER_SIZE - 1 or less, and returned as a string
 */
 char* receive(int sock) {
 	// Get length of data
+	OTP_PROBE1(receive_entry, sock);
 	int len;
-	if (recv(sock, &len, sizeof(len), 0) < 0)
+	checkDeadline();
+	if (recv(sock, &len, sizeof(len), MSG_WAITALL) != sizeof(len))
 		error(1, "Unable to read from socket");
+	if (len < 0)
+		error(1, "Invalid frame length: %d", len);
 	
-	// Init output
-	char* result = malloc(len + 1);
-	if (!result)
-		error(1, "Unable to allocate memory");
-	
-	// Loop over recv() for len amount of data
-	int charsRead;
-	for (int i = 0; i < len; i += charsRead) {
-		int size = len - i > BUFFER_SIZE - 1 ? BUFFER_SIZE - 1 : len - i;
-		charsRead = (int)recv(sock, result + i, size, 0);
-		if (charsRead < 0)
-			error(1, "Unable to read from socket");
-	}
-	
+	// Init output, then count the frame once it has all arrived
+	char* result = requestAlloc(len + 1);
+	receiveInto(sock, result, len);
 	result[len] = '\0';
+	statsCount(stats, COUNTER_RECV_CALLS, 1);
+	statsCount(stats, COUNTER_BYTES_IN, len);
+	OTP_PROBE2(receive_return, sock, len);
 	return result;
 }
 
 /**
  * @brief Validates whether the given socket is connected to an enc_client
  *
- * Recieves a "dec" message from the socket and sends a response to the client. If the response is not "dec", the function will close the socket and exit with an error code of 1.
+ * Recieves a "dec" message from the socket and sends a response to the client. If the response is not "dec", the request fails with an error code of 2. A client using Fast Open has already sent its request after the hello, so it is turned away after the fact, and what it sent is discarded.
  *
  * @param sock The socket to validate
  * @pre The socket is connected and able to send/receive data
- * @post The socket will be closed if the server's response is not "enc"
+ * @post The request has failed if the server's response is not "enc"
 */
 void validate(int sock) {
+	OTP_PROBE1(validate_entry, sock);
+	
 	// Init client/server validation vars
 	char client[4], server[4] = "dec";
 	memset(client, '\0', sizeof(client));
 	
 	// Recieve validation from client
-	if (recv(sock, client, sizeof(client), 0) < 0)
+	if (recv(sock, client, sizeof(client), MSG_WAITALL) < 0)
 		error(1, "Unable to read from socket");
 	
 	// Send validation to client
 	if (send(sock, server, sizeof(server), 0) < 0)
 		error(1, "Unable to write to socket");
+	statsCount(stats, COUNTER_RECV_CALLS, 1);
+	statsCount(stats, COUNTER_SEND_CALLS, 1);
 	
 	// Check client validation
+	OTP_PROBE2(validate_return, sock, !strcmp(client, server));
 	if (strcmp(client, server)) {
-		close(sock);
+		statsCount(stats, COUNTER_REJECTED, 1);
 		error(2, "Client not dec_client");
 	}
 }
 
+/**
+ * @brief Returns the length of the next frame without consuming it.
+ *
+ * @param sock The socket to peek at
+ * @return The length at the head of the next frame
+*/
+int peekLength(int sock) {
+	int len;
+	checkDeadline();
+	if (recv(sock, &len, sizeof(len), MSG_PEEK | MSG_WAITALL) < (ssize_t)sizeof(len))
+		error(1, "Unable to read from socket");
+	statsCount(stats, COUNTER_RECV_CALLS, 1);
+	return len;
+}
+
+/**
+ * @brief Reserves room in the memory budget for buffers this request is about to allocate, or turns the request away.
+ *
+ * Waits up to BUDGET_WAIT_MS for other requests to release memory. A request turned away gets a FRAME_BUSY length in place of its result, and whatever else it sends is read and discarded so the client sees that frame rather than a reset connection. Without a budget this does nothing.
+ *
+ * @param sock The socket of the request
+ * @param bytes The number of bytes to reserve
+*/
+void reserve(int sock, int64_t bytes) {
+	if (!budget || bytes <= 0)
+		return;
+	if (!budgetReserve(budget, budgetSlot, bytes, BUDGET_WAIT_MS)) {
+		reserved += bytes;
+		statsCount(stats, COUNTER_RESERVED_BYTES, bytes);
+		return;
+	}
+	
+	// Tell the client, then drain it until it hangs up
+	statsCount(stats, COUNTER_OVER_BUDGET, 1);
+	int frame = FRAME_BUSY;
+	send(sock, &frame, sizeof(frame), MSG_NOSIGNAL);
+	char discard[BUFFER_SIZE];
+	while (recv(sock, discard, sizeof(discard), 0) > 0)
+		checkDeadline();
+	error(3, "Request over memory budget");
+}
+
+/**
+ * @brief Gives everything this request has reserved back to the memory budget.
+*/
+void unreserve(void) {
+	if (!reserved)
+		return;
+	budgetRelease(budget, budgetSlot, reserved);
+	statsCount(stats, COUNTER_RESERVED_BYTES, -reserved);
+	reserved = 0;
+}
+
+/**
+ * @brief Handles a streamed one-time pad communication.
+ *
+ * Instead of a single text and key, the client sends a sequence of text and key chunk pairs using the same length-prefixed framing, and each chunk is decrypted and sent back before the next one is read. A zero-length text chunk marks the end of the stream. Only one chunk is held at a time, so memory use does not grow with the size of the stream. Each chunk is transformed over its text and sent back from there. On a worker thread the request deadline starts over with every chunk.
+ *
+ * @param sock The socket to use for communication.
+*/
+void handleOtpStream(int sock) {
+	while (1) {
+		// Each chunk gets a deadline of its own, so a long stream can keep going
+		if (requestDeadline)
+			requestDeadline = now() + WORKER_REQUEST_TIMEOUT_S * 1000000000ULL;
+		
+		// Reserve room for this chunk's text & a key as long
+		int64_t frameLen = budget ? peekLength(sock) : 0;
+		reserve(sock, 2 * (frameLen + 1));
+		
+		// Receive next text chunk, stop on the empty terminator
+		char* text = receive(sock);
+		int len = (int)strlen(text);
+		traceMark(&trace, PHASE_TEXT);
+		if (!len)
+			break;
+		trace.len += len;
+		
+		// Reserve room for a key chunk longer than the text, then receive it
+		if (budget)
+			reserve(sock, (int64_t)peekLength(sock) - frameLen);
+		char* key = receive(sock);
+		traceMark(&trace, PHASE_KEY);
+		if ((int)strlen(key) < len)
+			error(1, "Key chunk shorter than text chunk");
+		
+		// Transform chunk in place & send it back
+		OTP_PROBE1(transform_entry, len);
+		if (perfReady)
+			perfStart(&perf);
+		decryptTable(text, key, text, len);
+		if (perfReady) {
+			perfStop(&perf);
+			perfRecord(stats, &perf, len);
+		}
+		OTP_PROBE1(transform_return, len);
+		traceMark(&trace, PHASE_TRANSFORM);
+		sendData(sock, text);
+		traceMark(&trace, PHASE_SEND);
+		arenaReset(&arena, arenaIdleMs);
+		unreserve();
+	}
+}
+
+/**
+ * @brief Handles a request too large to buffer whole under the memory budget.
+ *
+ * The text has to be held in full, since the client sends all of it before the key, but the key is then received STREAM_CHUNK bytes at a time and each chunk is transformed into the text in place as it arrives. The request holds about len + STREAM_CHUNK bytes instead of twice len.
+ *
+ * @param sock The socket to use for communication.
+ * @param len The length of the text frame, already peeked
+*/
+void handleOtpLarge(int sock, int len) {
+	statsCount(stats, COUNTER_CHUNKED, 1);
+	reserve(sock, (int64_t)len + 1 + STREAM_CHUNK);
+	char* text = receive(sock);
+	traceMark(&trace, PHASE_TEXT);
+	trace.len = len;
+	
+	// Receive key length, it must cover the text
+	int keyLen;
+	checkDeadline();
+	if (recv(sock, &keyLen, sizeof(keyLen), MSG_WAITALL) < (ssize_t)sizeof(keyLen))
+		error(1, "Unable to read from socket");
+	statsCount(stats, COUNTER_RECV_CALLS, 1);
+	if (keyLen < len)
+		error(1, "Key shorter than text");
+	
+	// Transform the text in place a key chunk at a time
+	char* key = requestAlloc(STREAM_CHUNK);
+	OTP_PROBE1(transform_entry, len);
+	for (int i = 0; i < keyLen; i += STREAM_CHUNK) {
+		int chunk = keyLen - i < STREAM_CHUNK ? keyLen - i : STREAM_CHUNK;
+		receiveInto(sock, key, chunk);
+		if (i < len)
+			decryptTable(text + i, key, text + i, len - i < chunk ? len - i : chunk);
+	}
+	OTP_PROBE1(transform_return, len);
+	statsCount(stats, COUNTER_BYTES_IN, keyLen);
+	traceMark(&trace, PHASE_KEY);
+	traceMark(&trace, PHASE_TRANSFORM);
+	
+	// Send result back from the text buffer
+	sendData(sock, text);
+	traceMark(&trace, PHASE_SEND);
+}
+
 /**
  * @brief Handles a single one-time pad communication.
  *
- * This function receives plaintext and key from the given socket, decodes the plaintext using the one-time pad encryption algorithm, sends the resulting ciphertext back to the client through the socket, and closes the socket.
+ * This function receives plaintext and key from the given socket, decodes the plaintext using the one-time pad encryption algorithm, and sends the resulting ciphertext back to the client through the socket. The text is transformed in place and sent from its own buffer, so a request holds just its text and key. The caller closes the socket. If the first frame length is STREAM_FRAME, the request is handed to handleOtpStream() instead.
  *
  * @param sock The socket to use for communication.
 */
 void handleOtpComm(int sock) {
+	OTP_PROBE1(request_entry, sock);
+	
+	// Peek at the first frame length to check for a streamed request
+	int frameLen = peekLength(sock);
+	if (frameLen == STREAM_FRAME) {
+		recv(sock, &frameLen, sizeof(frameLen), 0);
+		statsCount(stats, COUNTER_RECV_CALLS, 1);
+		handleOtpStream(sock);
+		OTP_PROBE2(request_return, sock, trace.len);
+		return;
+	}
+	
+	// Requests that would take too much of the budget are transformed as the key arrives
+	if (budget && 2 * ((int64_t)frameLen + 1) > budget->limit / BUDGET_LARGE_SHARE) {
+		handleOtpLarge(sock, frameLen);
+		OTP_PROBE2(request_return, sock, frameLen);
+		return;
+	}
+	reserve(sock, 2 * ((int64_t)frameLen + 1));
+	
 	// Init dec vars
 	char* enc = receive(sock);
+	traceMark(&trace, PHASE_TEXT);
+	if (budget)
+		reserve(sock, (int64_t)peekLength(sock) - frameLen);
 	char* key = receive(sock);
+	traceMark(&trace, PHASE_KEY);
 	int len = (int)strlen(enc);
-	char* result = (char*) malloc(len + 1);
+	trace.len = len;
+	if ((int)strlen(key) < len)
+		error(1, "Key shorter than text");
 	
 	// Perform decryption
-	for (int i = 0; i < len; i++) {
-		int encVal = enc[i] == ' ' ? 26 : enc[i] - 'A';
-		int keyVal = key[i] == ' ' ? 26 : key[i] - 'A';
-		int txtVal = abs(encVal - keyVal + 27) % 27;
-		result[i] = txtVal == 26 ? ' ' : txtVal + 'A';
+	OTP_PROBE1(transform_entry, len);
+	if (perfReady)
+		perfStart(&perf);
+	parallelTransform(decryptTable, enc, key, enc, len);
+	if (perfReady) {
+		perfStop(&perf);
+		perfRecord(stats, &perf, len);
+	}
+	OTP_PROBE1(transform_return, len);
+	traceMark(&trace, PHASE_TRANSFORM);
+	
+	// Send decryted text back
+	sendData(sock, enc);
+	traceMark(&trace, PHASE_SEND);
+	OTP_PROBE2(request_return, sock, len);
+}
+
+/**
+ * @brief Exit handler for request children that returns the request's memory budget, takes it off the active gauge and records its resource usage, however the child exits.
+*/
+void requestDone(void) {
+	unreserve();
+	statsUsage(stats, NULL);
+	statsCount(stats, COUNTER_ACTIVE, -1);
+}
+
+/**
+ * @brief Signal handler for SIGCHLD that reaps every finished child and counts it off the running total.
+ *
+ * Helper processes are not request children and are only forgotten, so the count stays right if one of them dies. A child killed by a signal never ran its exit handler, so whatever it still held of the memory budget is reclaimed here, and it is taken off the active gauge.
+ *
+ * @param sig The signal number
+*/
+void reapChildren(int sig) {
+	(void)sig;
+	int savedErrno = errno, status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		int helper = 0;
+		for (int i = 0; i < helperCount; i++) {
+			if (helpers[i] == pid) {
+				helpers[i] = 0;
+				helper = 1;
+			}
+		}
+		if (helper)
+			continue;
+		children--;
+		int64_t leaked = budget ? budgetReap(budget, pid) : 0;
+		if (leaked)
+			statsCount(stats, COUNTER_RESERVED_BYTES, -leaked);
+		if (WIFSIGNALED(status))
+			statsCount(stats, COUNTER_ACTIVE, -1);
+	}
+	errno = savedErrno;
+}
+
+/**
+ * @brief Turns a connection away because the server is at its concurrency limit.
+ *
+ * Instead of the "dec" validation reply, the client gets BUSY_HELLO so it can back off and retry. Whatever part of the client's hello has already arrived is read first, so closing the socket does not reset the connection before the reply is read. Nothing here may block the accept loop.
+ *
+ * @param sock The connection to turn away
+*/
+void rejectBusy(int sock) {
+	char hello[4], busy[4] = BUSY_HELLO;
+	recv(sock, hello, sizeof(hello), MSG_DONTWAIT);
+	send(sock, busy, sizeof(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+	statsCount(stats, COUNTER_BUSY, 1);
+	close(sock);
+}
+
+/**
+ * @brief Signal handler for SIGUSR1 that asks the main loop to print the phase statistics.
+ *
+ * Printing is left to the main loop, since stdio is not safe to use from a signal handler.
+ *
+ * @param sig The signal number
+*/
+void requestStats(int sig) {
+	(void)sig;
+	statsRequested = 1;
+}
+
+/**
+ * @brief Forks a child to handle a connection, and counts it as running.
+ *
+ * SIGCHLD is held until the child has been counted, so the count cannot be taken down before it goes up. The child ignores SIGPIPE, so a client hanging up fails the request through error() and the exit handler still returns its memory budget. With CPUs set by -P, children are pinned to them in turn.
+ *
+ * @param sock The accepted connection
+ * @param client The address of the client
+ * @param acceptTime When the connection was accepted
+ * @param validated Nonzero if the handshake has already been done, by the scheduler
+*/
+void dispatch(int sock, const struct sockaddr_in* client, uint64_t acceptTime, int validated) {
+	static unsigned long dispatched = 0;
+	int cpu = cpuCount ? cpus[dispatched++ % cpuCount] : -1;
+	sigset_t savedMask;
+	sigprocmask(SIG_BLOCK, &childMask, &savedMask);
+	int pid = fork();
+	switch (pid) {
+		case -1:
+			// Fork error
+			error(1, "Unable to fork child");
+			break;
+		case 0:
+			// Child case
+			sigprocmask(SIG_UNBLOCK, &childMask, NULL);
+			signal(SIGPIPE, SIG_IGN);
+			if (sched)
+				schedCloseAll(sched);
+			if (budget)
+				budgetSlot = budgetClaim(budget, getpid());
+			if (cpu >= 0)
+				pinToCpu(cpu, bindMemory);
+			statsCount(stats, COUNTER_ACTIVE, 1);
+			atexit(requestDone);
+			int on = 1;
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			peer = *client;
+			traceStart(&trace, acceptTime);
+			traceMark(&trace, PHASE_FORK);
+			perfReady = perfEnabled && !perfOpen(&perf);
+			if (!validated)
+				validate(sock);
+			traceMark(&trace, PHASE_VALIDATE);
+			handleOtpComm(sock);
+			close(sock);
+			statsRecord(stats, &trace, traceFd);
+			if (accessLog)
+				logRequest(accessLog, &trace, &peer, "dec", 0);
+			exit(0);
+		default:
+			// Parent case
+			children++;
+			sigprocmask(SIG_SETMASK, &savedMask, NULL);
+			close(sock);
+	}
+}
+
+/**
+ * @brief Handles a connection on a worker thread in threaded mode, then closes it.
+ *
+ * Does what a forked child does, but a failing request returns here through error() instead of exiting, so everything a child would leave to exit() is undone by hand: the request's arena is reset for the next one, its memory budget returned and its socket closed. A client that stops sending or reading for WORKER_IO_TIMEOUT_S, or whose request is not done within WORKER_REQUEST_TIMEOUT_S, fails its request, so idle or trickling connections cannot hold every worker. Hardware counters are opened on the worker's first request and kept open for the rest. Context switches are counted for this thread since the request started.
+ *
+ * @param sock The accepted connection
+ * @param client The address of the client
+ * @param acceptTime When the connection was accepted
+*/
+void handleThreaded(int sock, const struct sockaddr_in* client, uint64_t acceptTime) {
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	statsCount(stats, COUNTER_ACTIVE, 1);
+	jmp_buf failed;
+	if (!setjmp(failed)) {
+		requestJump = &failed;
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		struct timeval timeout = {WORKER_IO_TIMEOUT_S, 0};
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		requestDeadline = acceptTime + WORKER_REQUEST_TIMEOUT_S * 1000000000ULL;
+		peer = *client;
+		traceStart(&trace, acceptTime);
+		traceMark(&trace, PHASE_FORK);
+		if (perfEnabled && !perfReady)
+			perfReady = !perfOpen(&perf);
+		validate(sock);
+		traceMark(&trace, PHASE_VALIDATE);
+		handleOtpComm(sock);
+		statsRecord(stats, &trace, traceFd);
+		if (accessLog)
+			logRequest(accessLog, &trace, &peer, "dec", 0);
 	}
-	result[len] = '\0';
 	
-	// Send decryted text back, free data & close socket
-	sendData(sock, result);
-	free(result);
-	free(enc);
-	free(key);
+	// Clean up after the request, whether it finished or failed
+	requestJump = NULL;
+	requestDeadline = 0;
+	arenaReset(&arena, arenaIdleMs);
+	unreserve();
 	close(sock);
+	statsUsage(stats, &usage);
+	statsCount(stats, COUNTER_ACTIVE, -1);
 }
 
 /**
@@ -192,50 +707,241 @@ void handleOtpComm(int sock) {
  * @return 0 if the program exits normally, and a non-zero integer if an error occurs.
 */
 int main(int argc, const char * argv[]) {
-	// Check usage & args
-	if (argc < 2)
-		error(1, "USAGE: %s port\n", argv[0]);
-
-	// Create the socket that will listen for connections
-	int listenSock = socket(AF_INET, SOCK_STREAM, 0);
-	if (listenSock < 0)
-		error(1, "Unable to open socket");
+	// Parse options
+	int opt, metricsPort = 0, backlog = SOMAXCONN, acceptors = 1, fastOpen = 0, shortestFirst = 0, threads = -1, prefault = 0;
+	long long hugeThreshold = 0;
+	char *statsPath = NULL, *logPath = NULL;
+	while ((opt = getopt(argc, (char* const*) argv, "t:m:s:l:pc:M:b:a:f:ST:P:NI:H:W")) != -1) {
+		switch (opt) {
+			case 't':
+				traceFd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+				if (traceFd < 0)
+					error(1, "Unable to open trace file: %s", optarg);
+				break;
+			case 'm':
+				metricsPort = atoi(optarg);
+				break;
+			case 's':
+				statsPath = optarg;
+				break;
+			case 'l':
+				logPath = optarg;
+				break;
+			case 'p':
+				perfEnabled = 1;
+				break;
+			case 'c':
+				maxChildren = atoi(optarg);
+				break;
+			case 'b':
+				backlog = atoi(optarg);
+				break;
+			case 'a':
+				acceptors = atoi(optarg);
+				if (acceptors < 1)
+					error(1, "Invalid acceptor count: %s", optarg);
+				break;
+			case 'S':
+				shortestFirst = 1;
+				break;
+			case 'f':
+				fastOpen = atoi(optarg);
+				break;
+			case 'P':
+				cpus = malloc(AFFINITY_MAX_CPUS * sizeof(int));
+				if (!cpus || (cpuCount = cpuListParse(optarg, cpus, AFFINITY_MAX_CPUS)) < 0)
+					error(1, "Invalid CPU list: %s", optarg);
+				break;
+			case 'N':
+				bindMemory = 1;
+				break;
+			case 'H':
+				hugeThreshold = atoll(optarg);
+				if (hugeThreshold < 0)
+					error(1, "Invalid huge page threshold: %s", optarg);
+				break;
+			case 'W':
+				prefault = 1;
+				break;
+			case 'I':
+				arenaIdleMs = atoi(optarg);
+				break;
+			case 'T':
+				threads = atoi(optarg);
+				if (threads < 0)
+					error(1, "Invalid thread count: %s", optarg);
+				break;
+			case 'M':
+				if (!(budget = budgetCreate(atoll(optarg))))
+					error(1, "Unable to create memory budget");
+				break;
+			default:
+				error(1, "USAGE: %s [-t tracefile] [-m metricsport] [-s statsfile] [-l logfile] [-p] [-c maxrequests [-S]] [-M budgetbytes] [-b backlog] [-a acceptors] [-f fastopenqueue] [-T threads [-I arenaidlems]] [-P cpulist [-N]] [-H hugebytes [-W]] port\n", argv[0]);
+		}
+	}
+	
+	// Check usage & args, shortest first only matters when requests have to wait
+	if (shortestFirst && !maxChildren)
+		error(1, "-S needs a request limit set with -c");
+	if (bindMemory && !cpuCount)
+		error(1, "-N needs CPUs set with -P");
+	if (prefault && !hugeThreshold)
+		error(1, "-W needs a huge page threshold set with -H");
+	if (threads >= 0 && maxChildren)
+		error(1, "-T cannot be combined with -c, the thread count limits requests");
+	if (argc - optind < 1)
+		error(1, "USAGE: %s [-t tracefile] [-m metricsport] [-s statsfile] [-l logfile] [-p] [-c maxrequests [-S]] [-M budgetbytes] [-b backlog] [-a acceptors] [-f fastopenqueue] [-T threads [-I arenaidlems]] [-P cpulist [-N]] [-H hugebytes [-W]] port\n", argv[0]);
+	
+	// Back buffers of at least the threshold with huge pages if asked for
+	arenaConfigure(hugeThreshold, prefault);
+	
+	// Create shared stats & print them on SIGUSR1
+	stats = statsCreate(statsPath);
+	if (!stats)
+		error(1, "Unable to create stats");
+	struct sigaction action = {0};
+	action.sa_handler = requestStats;
+	sigaction(SIGUSR1, &action, NULL);
+	
+	// Reap request children as they finish
+	struct sigaction reap = {0};
+	reap.sa_handler = reapChildren;
+	reap.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &reap, NULL);
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	
+	// Hold SIGCHLD until every helper's process ID has been noted
+	sigset_t helperMask;
+	sigprocmask(SIG_BLOCK, &childMask, &helperMask);
+	if (!(helpers = malloc((acceptors + 2) * sizeof(pid_t))))
+		error(1, "Unable to allocate memory");
+	
+	// Serve metrics from a separate process if asked for
+	if (metricsPort)
+		helpers[helperCount++] = serveMetrics(stats, "dec_server", metricsPort);
+	
+	// Write the access log from a separate process if asked for
+	if (logPath && !(accessLog = logCreate(logPath)))
+		error(1, "Unable to open access log: %s", logPath);
+	if (accessLog)
+		helpers[helperCount++] = accessLog->logger;
+	
+	// Check hardware counters can be opened before relying on them in children
+	if (perfEnabled) {
+		if (perfOpen(&perf) < 0)
+			error(1, "Unable to open hardware performance counters: %s", strerror(errno));
+		perfClose(&perf);
+	}
 
-	// Set up the address struct for the server socket
-	struct sockaddr_in server, client;
+	// Open every acceptor's listening socket up front so errors show at startup
+	int port = atoi(argv[optind]);
+	int* listeners = malloc(acceptors * sizeof(int));
+	if (!listeners)
+		error(1, "Unable to allocate memory");
+	for (int i = 0; i < acceptors; i++)
+		listeners[i] = openListener(port, backlog, acceptors > 1, fastOpen);
+	
+	// Fork the extra acceptors, which run the same loop below on their own socket and die with the server
+	int listenSock = listeners[0], acceptor = 0;
+	for (int i = 1; i < acceptors; i++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			error(1, "Unable to fork acceptor");
+		if (!pid) {
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			signal(SIGUSR1, SIG_IGN);
+			listenSock = listeners[i];
+			acceptor = i;
+			helperCount = 0;
+			break;
+		}
+		helpers[helperCount++] = pid;
+	}
+	sigprocmask(SIG_SETMASK, &helperMask, NULL);
+	for (int i = 0; i < acceptors; i++)
+		if (listeners[i] != listenSock)
+			close(listeners[i]);
+	free(listeners);
+	
+	// Keep this acceptor to its share of the listed CPUs, and have the kernel steer connections taken on its first CPU to it
+	if (cpuCount) {
+		int share = 0;
+		for (int i = acceptor % cpuCount; i < cpuCount; i += acceptors)
+			cpus[share++] = cpus[i];
+		cpuCount = share;
+		if (pinToCpu(cpus[0], bindMemory) < 0)
+			error(1, "Unable to pin to CPU %d: %s", cpus[0], strerror(errno));
+		if (acceptors > 1 && steerIncoming(listenSock, cpus[0]) < 0)
+			error(1, "Unable to steer connections to CPU %d", cpus[0]);
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < cpuCount; i++)
+			CPU_SET(cpus[i], &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	
+	// Serve from a pool of pinned worker threads if asked for, leaving this thread to print stats
+	if (threads >= 0) {
+		if (poolStart(listenSock, threads, bindMemory, handleThreaded, workerIdle) < 0)
+			error(1, "Unable to start worker threads");
+		while (1) {
+			pause();
+			if (statsRequested) {
+				statsRequested = 0;
+				statsPrint(stats, stderr);
+			}
+		}
+	}
+	
+	// Schedule shortest requests first if asked for, holding SIGCHLD except while waiting
+	if (shortestFirst) {
+		sched = schedCreate(listenSock, "dec", stats, SCHED_MAX_CONNS);
+		if (!sched)
+			error(1, "Unable to allocate memory");
+		sigset_t waitMask;
+		sigprocmask(SIG_BLOCK, &childMask, &waitMask);
+		while (1) {
+			if (statsRequested) {
+				statsRequested = 0;
+				statsPrint(stats, stderr);
+			}
+			struct job job;
+			while (children < maxChildren && schedNext(sched, &job))
+				dispatch(job.sock, &job.client, job.acceptTime, 1);
+			if (schedWait(sched, &waitMask) < 0)
+				error(1, "Unable to accept connection");
+		}
+	}
+	
+	struct sockaddr_in client;
 	socklen_t clientSize = sizeof(client);
-	setupAddressStruct(&server, atoi(argv[1]));
-
-	// Associate the socket to the port
-	if (bind(listenSock, (struct sockaddr *) &server, sizeof(server)) < 0)
-		error(1, "Unable to bind socket");
-
-	// Start listening for connetions. Allow up to 5 connections to queue up
-	listen(listenSock, 5);
 	while (1) {
+		// Print stats if asked for since the last connection
+		if (statsRequested) {
+			statsRequested = 0;
+			statsPrint(stats, stderr);
+		}
+		
 		// Accept the connection request which creates a connection socket
-		int sock = accept(listenSock, (struct sockaddr *)&client, &clientSize);
+		// Request handlers use blocking I/O, so only close-on-exec is set on the connection
+		int sock = accept4(listenSock, (struct sockaddr *)&client, &clientSize, SOCK_CLOEXEC);
+		if (sock < 0 && errno == EINTR)
+			continue;
 		if (sock < 0)
 			error(1, "Unable to accept connection");
+		uint64_t acceptTime = now();
+		
+		// Turn the connection away if too many requests are running
+		if (maxChildren && children >= maxChildren) {
+			rejectBusy(sock);
+			continue;
+		}
 
 		// Fork children to handle client connections
-		int pid = fork();
-		switch (pid) {
-			case -1:
-				// Fork error
-				error(1, "Unable to fork child");
-				break;
-			case 0:
-				// Child case
-				validate(sock);
-				handleOtpComm(sock);
-				exit(0);
-			default:
-				// Parent case
-				close(sock);
-		}
+		dispatch(sock, &client, acceptTime, 0);
 	}
-
+	
 	// Close the listening socket
 	close(listenSock);
 	return 0;
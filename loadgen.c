@@ -0,0 +1,542 @@
+/**
+ * @file loadgen.c
+ * @brief Load generator and latency benchmark for enc_server and dec_server.
+ *
+ * This program opens a configurable number of concurrent connections to an enc_server or dec_server, drives a mix of message sizes against it either closed-loop or at a target request rate, and checks every response against a local copy of the one-time pad transform. With -F, requests are sent over TCP Fast Open without waiting for validation, as with the clients' --fastopen. A size of 0 sends empty requests, which measures the rate at which the server can accept, fork and validate connections, for example with thousands of connections at once. With a decryption port given, every ciphertext is also sent back through dec_server to verify the full roundtrip. At the end it reports throughput and latency percentiles from a log-linear histogram in the style of HdrHistogram.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define HIST_BUCKETS 64
+#define HIST_SUB_BITS 6
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define MAX_SIZES 32
+#define WORKER_STACK (256 * 1024)
+
+/**
+ * @brief Reports an error message to the standard error output and exits the program.
+ *
+ * @param exitCode The exit code to exit the program with.
+ * @param format The format string for the error message.
+ * @param ... Additional arguments to be included in the error message.
+ *
+ * @return Does not return; exits the program.
+ */
+int error(int exitCode, const char *format, ...) {
+	// Retrieve additional arguments
+	va_list args;
+	va_start(args, format);
+	
+	// Print error to stderr
+	fprintf(stderr, "Loadgen error: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	
+	// End var arg list & exit
+	va_end(args);
+	exit(exitCode);
+}
+
+/**
+ * @brief A latency histogram with buckets for every power of two, each split into HIST_SUB_BUCKETS linear sub-buckets.
+ *
+ * Values below HIST_SUB_BUCKETS are counted exactly in bucket 0, and every larger value is shifted down into the upper half of a bucket's sub-buckets. This keeps the relative error of any recorded value under 4% while covering nanoseconds to centuries in a fixed 32 KB table.
+*/
+struct histogram {
+	uint64_t counts[HIST_BUCKETS][HIST_SUB_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+/**
+ * @brief Records a single value in a histogram.
+ *
+ * @param hist The histogram to record into
+ * @param value The value to record
+*/
+void histRecord(struct histogram* hist, uint64_t value) {
+	// Values below the sub-bucket count land in bucket 0 exactly
+	int bucket = 0;
+	uint64_t sub = value;
+	if (value >= HIST_SUB_BUCKETS) {
+		bucket = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+		sub = value >> bucket;
+	}
+	hist->counts[bucket][sub]++;
+	
+	// Track totals & extremes
+	if (!hist->total || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->total++;
+}
+
+/**
+ * @brief Returns the lowest value of a histogram bucket.
+ *
+ * @param bucket The power of two bucket
+ * @param sub The linear sub-bucket
+ * @return The smallest value that is recorded into that sub-bucket
+*/
+uint64_t histValue(int bucket, int sub) {
+	return (uint64_t)sub << bucket;
+}
+
+/**
+ * @brief Adds every count of one histogram into another.
+ *
+ * @param into The histogram to add to
+ * @param from The histogram to add
+*/
+void histMerge(struct histogram* into, struct histogram* from) {
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		for (int s = 0; s < HIST_SUB_BUCKETS; s++)
+			into->counts[b][s] += from->counts[b][s];
+	if (from->total && (!into->total || from->min < into->min))
+		into->min = from->min;
+	if (from->max > into->max)
+		into->max = from->max;
+	into->total += from->total;
+}
+
+/**
+ * @brief Finds the value at a given percentile of a histogram.
+ *
+ * @param hist The histogram to search
+ * @param percentile The percentile to find, from 0 to 100
+ * @return The lowest value of the bucket holding that percentile
+*/
+uint64_t histPercentile(struct histogram* hist, double percentile) {
+	uint64_t target = (uint64_t)(hist->total * percentile / 100.0 + 0.5), seen = 0;
+	if (target < 1)
+		target = 1;
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		for (int s = 0; s < HIST_SUB_BUCKETS; s++)
+			if ((seen += hist->counts[b][s]) >= target) {
+				uint64_t value = histValue(b, s);
+				return value < hist->min ? hist->min : value > hist->max ? hist->max : value;
+			}
+	return hist->max;
+}
+
+/**
+ * @brief Returns the current time of the monotonic clock in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary fixed point
+*/
+uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief The settings for a run, shared by every connection thread.
+*/
+struct config {
+	struct sockaddr_in server;
+	struct sockaddr_in decServer;
+	int roundtrip;
+	int decrypt;
+	int fastOpen;
+	int connections;
+	long requests;
+	double rate;
+	int sizes[MAX_SIZES];
+	int sizeCount;
+};
+
+/**
+ * @brief The results of one connection thread, merged once the run is over.
+*/
+struct worker {
+	struct config* config;
+	int id;
+	long requests;
+	long ok;
+	long errors;
+	long busy;
+	long mismatches;
+	uint64_t bytes;
+	struct histogram latency;
+};
+
+/**
+ * @brief Sends the whole buffer over a socket, looping over short sends.
+ *
+ * @param sock The socket to send over
+ * @param data The data to send
+ * @param len The number of bytes to send
+ * @param flags Extra send() flags, such as MSG_MORE
+ * @return 0 on success, or -1 on error
+*/
+int sendAll(int sock, const void* data, size_t len, int flags) {
+	while (len > 0) {
+		ssize_t charsSent = send(sock, data, len, flags | MSG_NOSIGNAL);
+		if (charsSent <= 0)
+			return -1;
+		data = (const char*) data + charsSent;
+		len -= charsSent;
+	}
+	return 0;
+}
+
+/**
+ * @brief Receives exactly len bytes from a socket, looping over short reads.
+ *
+ * @param sock The socket to receive from
+ * @param data The buffer to receive into
+ * @param len The number of bytes to receive
+ * @return 0 on success, or -1 on error or if the peer closes early
+*/
+int recvAll(int sock, void* data, size_t len) {
+	while (len > 0) {
+		ssize_t charsRead = recv(sock, data, len, 0);
+		if (charsRead <= 0)
+			return -1;
+		data = (char*) data + charsRead;
+		len -= charsRead;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sends a length-prefixed frame, matching the framing of sendData() in the clients and servers.
+ *
+ * The length is flagged MSG_MORE so it leaves in the same segment as the data.
+ *
+ * @param sock The socket to send over
+ * @param data The data to send
+ * @param len The number of bytes to send
+ * @return 0 on success, or -1 on error
+*/
+int sendFrame(int sock, const char* data, int len) {
+	if (sendAll(sock, &len, sizeof(len), len ? MSG_MORE : 0) < 0)
+		return -1;
+	return sendAll(sock, data, len, 0);
+}
+
+/**
+ * @brief Runs one full request against a server: connect, validate, send text and key, receive the result.
+ *
+ * With Fast Open, the hello and text length are sent in the SYN with MSG_FASTOPEN and the text and key follow at once, with the server's validation reply only checked afterwards, as the clients do with --fastopen. Where the kernel has client-side Fast Open turned off, the request is sent the same way over a plain connect().
+ *
+ * @param server The address of the server
+ * @param hello The validation message the server expects, "enc" or "dec"
+ * @param text The text to send
+ * @param key The key to send
+ * @param result The buffer to receive the result into, at least len bytes
+ * @param len The number of characters in the text
+ * @param fastOpen Nonzero to send the request without waiting for validation
+ * @return 0 on success, -2 if the server turned the request away as busy or over its memory budget, or -1 on any other error
+*/
+int request(struct sockaddr_in* server, const char* hello, const char* text, const char* key, char* result, int len, int fastOpen) {
+	// Open socket, sending frames as soon as they are complete
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	
+	// Send the request, before or after validation
+	char reply[4] = {0};
+	int failed;
+	if (fastOpen) {
+		struct {
+			char hello[4];
+			int len;
+		} head = {{0}, len};
+		memcpy(head.hello, hello, sizeof(head.hello));
+		ssize_t sent = sendto(sock, &head, sizeof(head), MSG_FASTOPEN | MSG_NOSIGNAL, (struct sockaddr*) server, sizeof(*server));
+		if (sent < 0 && errno == EOPNOTSUPP)
+			sent = connect(sock, (struct sockaddr*) server, sizeof(*server)) < 0 ? -1 : send(sock, &head, sizeof(head), MSG_NOSIGNAL);
+		failed = sent != (ssize_t)sizeof(head) || sendAll(sock, text, len, 0) < 0 || sendFrame(sock, key, len) < 0;
+		if (recvAll(sock, reply, sizeof(reply)) < 0)
+			failed = 1;
+	} else {
+		failed = connect(sock, (struct sockaddr*) server, sizeof(*server)) < 0
+			|| sendAll(sock, hello, 4, 0) < 0 || recvAll(sock, reply, sizeof(reply)) < 0;
+		if (!failed && !strcmp(reply, hello))
+			failed = sendFrame(sock, text, len) < 0 || sendFrame(sock, key, len) < 0;
+	}
+	if (!strcmp(reply, "bsy")) {
+		close(sock);
+		return -2;
+	}
+	
+	// Receive result
+	int resultLen = -1;
+	int status = failed || strcmp(reply, hello)
+		|| recvAll(sock, &resultLen, sizeof(resultLen)) < 0 || resultLen != len
+		|| recvAll(sock, result, len) < 0 ? -1 : 0;
+	if (resultLen == -2)
+		status = -2;
+	close(sock);
+	return status;
+}
+
+/**
+ * @brief Applies the one-time pad transform locally, to check server responses against.
+ *
+ * @param text The text to transform
+ * @param key The key to transform with
+ * @param result The buffer to write the output to
+ * @param len The number of characters to transform
+ * @param decrypt Nonzero to decrypt, zero to encrypt
+*/
+void reference(const char* text, const char* key, char* result, int len, int decrypt) {
+	for (int i = 0; i < len; i++) {
+		int txtVal = text[i] == ' ' ? 26 : text[i] - 'A';
+		int keyVal = key[i] == ' ' ? 26 : key[i] - 'A';
+		int val = decrypt ? (txtVal - keyVal + 27) % 27 : (txtVal + keyVal) % 27;
+		result[i] = val == 26 ? ' ' : val + 'A';
+	}
+}
+
+/**
+ * @brief Thread entry point that drives requests over one connection slot until its share of the run is done.
+ *
+ * In closed-loop mode each request starts as soon as the previous one finishes. With a target rate, requests are scheduled at fixed intervals and latency is measured from the scheduled start rather than the actual one, so a stalled server is charged for the requests it held up instead of hiding them.
+ *
+ * @param arg A pointer to the worker to run
+ * @return NULL
+*/
+void* runWorker(void* arg) {
+	struct worker* worker = arg;
+	struct config* config = worker->config;
+	unsigned int seed = (unsigned int)now() ^ (worker->id * 2654435761u);
+	
+	// Size buffers for the largest message
+	int maxLen = 0;
+	for (int i = 0; i < config->sizeCount; i++)
+		if (config->sizes[i] > maxLen)
+			maxLen = config->sizes[i];
+	char* text = malloc(maxLen + 1);
+	char* key = malloc(maxLen + 1);
+	char* result = malloc(maxLen + 1);
+	char* expected = malloc(maxLen + 1);
+	char* back = malloc(maxLen + 1);
+	if (!text || !key || !result || !expected || !back)
+		error(1, "Unable to allocate memory");
+	
+	// Work out the interval between scheduled requests for this thread
+	uint64_t interval = config->rate > 0 ? (uint64_t)(1e9 * config->connections / config->rate) : 0;
+	uint64_t start = now();
+	
+	for (long n = 0; n < worker->requests; n++) {
+		// Pick a size & fill text and key with random symbols
+		int len = config->sizes[rand_r(&seed) % config->sizeCount];
+		for (int i = 0; i < len; i++) {
+			text[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[rand_r(&seed) % 27];
+			key[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[rand_r(&seed) % 27];
+		}
+	
+		// Wait for the scheduled start in open-loop mode
+		uint64_t begin = now();
+		if (interval) {
+			uint64_t scheduled = start + n * interval;
+			if (scheduled > begin) {
+				struct timespec delay = {(scheduled - begin) / 1000000000, (scheduled - begin) % 1000000000};
+				nanosleep(&delay, NULL);
+			}
+			begin = scheduled;
+		}
+	
+		// Send request, and the roundtrip back through dec_server if asked
+		const char* hello = config->decrypt ? "dec" : "enc";
+		int status = request(&config->server, hello, text, key, result, len, config->fastOpen);
+		if (!status && config->roundtrip)
+			status = request(&config->decServer, "dec", result, key, back, len, config->fastOpen);
+		if (status == -2) {
+			worker->busy++;
+			continue;
+		}
+		if (status < 0) {
+			worker->errors++;
+			continue;
+		}
+		histRecord(&worker->latency, now() - begin);
+		worker->bytes += len;
+	
+		// Verify response
+		reference(text, key, expected, len, config->decrypt);
+		if (memcmp(result, expected, len) || (config->roundtrip && memcmp(back, text, len)))
+			worker->mismatches++;
+		else
+			worker->ok++;
+	}
+	
+	// Free buffers
+	free(text);
+	free(key);
+	free(result);
+	free(expected);
+	free(back);
+	return NULL;
+}
+
+/**
+ * @brief Parses a comma separated list of message sizes.
+ *
+ * @param list The list to parse
+ * @param config The config to store the sizes in
+*/
+void parseSizes(char* list, struct config* config) {
+	config->sizeCount = 0;
+	for (char* size = strtok(list, ","); size; size = strtok(NULL, ",")) {
+		if (config->sizeCount == MAX_SIZES)
+			error(1, "Too many sizes, at most %d", MAX_SIZES);
+		if ((config->sizes[config->sizeCount++] = atoi(size)) < 0)
+			error(1, "Invalid size: %s", size);
+	}
+}
+
+/**
+ * @brief Sets up a sockaddr_in struct for localhost at the given port.
+ *
+ * @param address A pointer to the sockaddr_in struct to be set up.
+ * @param portNumber The port number to be stored in the sin_port field of the address struct.
+*/
+void setupAddressStruct(struct sockaddr_in* address, int portNumber) {
+	// Clear out the address struct
+	memset((char*) address, '\0', sizeof(*address));
+	
+	// The address should be network capable
+	address->sin_family = AF_INET;
+	address->sin_port = htons(portNumber);
+	
+	// Get the DNS entry for localhost
+	struct hostent* hostInfo = gethostbyname("localhost");
+	if (hostInfo == NULL)
+		error(1, "No such host");
+	memcpy((char*) &address->sin_addr.s_addr, hostInfo->h_addr_list[0], hostInfo->h_length);
+}
+
+/**
+ * @brief The main function for the load generator.
+ *
+ * Parses the options, starts one thread per connection, waits for all of them to finish their share of the requests and prints the combined results.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ * @return 0 if every request succeeded and verified, 1 otherwise.
+*/
+int main(int argc, char * argv[]) {
+	const char* usage = "USAGE: %s [-c connections] [-n requests] [-r rate] [-s size,size,...] [-d] [-R decport] [-F] port";
+	
+	// Set defaults
+	struct config config;
+	memset(&config, 0, sizeof(config));
+	config.connections = 5;
+	config.requests = 1000;
+	char defaultSizes[] = "17,1000,70000";
+	parseSizes(defaultSizes, &config);
+	
+	// Parse options
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:r:s:dR:F")) != -1) {
+		switch (opt) {
+			case 'c':
+				config.connections = atoi(optarg);
+				break;
+			case 'n':
+				config.requests = atol(optarg);
+				break;
+			case 'r':
+				config.rate = atof(optarg);
+				break;
+			case 's':
+				parseSizes(optarg, &config);
+				break;
+			case 'd':
+				config.decrypt = 1;
+				break;
+			case 'F':
+				config.fastOpen = 1;
+				break;
+			case 'R':
+				config.roundtrip = 1;
+				setupAddressStruct(&config.decServer, atoi(optarg));
+				break;
+			default:
+				error(1, usage, argv[0]);
+		}
+	}
+	if (optind >= argc || config.connections < 1 || config.requests < 1)
+		error(1, usage, argv[0]);
+	if (config.roundtrip && config.decrypt)
+		error(1, "-R only applies when driving enc_server");
+	setupAddressStruct(&config.server, atoi(argv[optind]));
+	
+	// Allow a socket per connection, with small thread stacks so thousands fit
+	struct rlimit files;
+	if (!getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+	
+	// Start a thread per connection, spreading the requests between them
+	struct worker* workers = calloc(config.connections, sizeof(*workers));
+	pthread_t* threads = calloc(config.connections, sizeof(*threads));
+	if (!workers || !threads)
+		error(1, "Unable to allocate memory");
+	uint64_t start = now();
+	for (int i = 0; i < config.connections; i++) {
+		workers[i].config = &config;
+		workers[i].id = i;
+		workers[i].requests = config.requests / config.connections + (i < config.requests % config.connections);
+		if (pthread_create(&threads[i], &attr, runWorker, &workers[i]))
+			error(1, "Unable to start worker thread");
+	}
+	
+	// Wait for workers & merge their results
+	struct histogram* latency = calloc(1, sizeof(*latency));
+	long ok = 0, errors = 0, busy = 0, mismatches = 0;
+	uint64_t bytes = 0;
+	for (int i = 0; i < config.connections; i++) {
+		pthread_join(threads[i], NULL);
+		histMerge(latency, &workers[i].latency);
+		ok += workers[i].ok;
+		errors += workers[i].errors;
+		busy += workers[i].busy;
+		mismatches += workers[i].mismatches;
+		bytes += workers[i].bytes;
+	}
+	double seconds = (now() - start) / 1e9;
+	
+	// Print results
+	printf("requests:   %ld ok, %ld errors, %ld busy, %ld mismatched\n", ok, errors, busy, mismatches);
+	printf("duration:   %.3f s\n", seconds);
+	printf("throughput: %.1f req/s, %.2f MB/s\n", (ok + mismatches) / seconds, bytes / seconds / 1e6);
+	if (latency->total)
+		printf("latency us: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+			latency->min / 1e3, histPercentile(latency, 50) / 1e3, histPercentile(latency, 90) / 1e3,
+			histPercentile(latency, 99) / 1e3, histPercentile(latency, 99.9) / 1e3, latency->max / 1e3);
+	
+	// Free results
+	free(latency);
+	free(threads);
+	free(workers);
+	return errors || mismatches;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file otp_affinity.c
+ * @brief CPU pinning, NUMA memory binding and connection steering for the servers' request workers.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "otp_affinity.h"
+
+/**
+ * @brief Parses a CPU list such as "0-3,8,10-11", in the format of taskset and /sys.
+ *
+ * @param list The CPU list
+ * @param cpus Filled with the CPUs in the order listed
+ * @param max The most CPUs cpus can hold
+ * @return The number of CPUs, or -1 if the list is malformed, empty or too long
+*/
+int cpuListParse(const char* list, int* cpus, int max) {
+	int count = 0;
+	while (*list) {
+		// Read a CPU or a range of them
+		char* end;
+		long first = strtol(list, &end, 10), last = first;
+		if (end == list || first < 0)
+			return -1;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first)
+				return -1;
+		}
+		
+		// Add the range & move past the comma
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (count == max || cpu >= CPU_SETSIZE)
+				return -1;
+			cpus[count++] = (int)cpu;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		list = end;
+	}
+	return count ? count : -1;
+}
+
+/**
+ * @brief Pins the calling thread to one CPU, and optionally binds its memory to that CPU's NUMA node.
+ *
+ * The node is read back with getcpu once the thread is running on the CPU. Memory is bound with MPOL_BIND, so pages this thread touches from then on are placed on its own node rather than wherever there happened to be room. The policy and mask are per thread, and inherited by children forked or threads started afterwards. The raw system calls are used so the servers do not need libnuma.
+ *
+ * @param cpu The CPU to pin to
+ * @param bindMemory Nonzero to bind memory to the CPU's node
+ * @return 0 on success, or -1 if the CPU is not available or memory could not be bound
+*/
+int pinToCpu(int cpu, int bindMemory) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		return -1;
+	if (!bindMemory)
+		return 0;
+	
+	// Bind to the node the thread now runs on
+	unsigned int runningCpu, node;
+	if (syscall(SYS_getcpu, &runningCpu, &node, NULL) < 0)
+		return -1;
+	unsigned long nodes[16] = {0};
+	if (node >= sizeof(nodes) * 8)
+		return -1;
+	nodes[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+	return syscall(SYS_set_mempolicy, MPOL_BIND, nodes, sizeof(nodes) * 8) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Steers new connections on a port shared with SO_REUSEPORT to the listening socket of the acceptor on a given CPU.
+ *
+ * When every acceptor sets this to the CPU it is pinned to, the kernel hands a new connection to the acceptor on the CPU that processed its SYN, which with the NIC's interrupts affined to its local node keeps the connection there from the first packet.
+ *
+ * @param sock A listening socket sharing its port with SO_REUSEPORT
+ * @param cpu The CPU the socket's acceptor is pinned to
+ * @return 0 on success, or -1 on failure
+*/
+int steerIncoming(int sock, int cpu) {
+	return setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
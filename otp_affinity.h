@@ -0,0 +1,19 @@
+/**
+ * @file otp_affinity.h
+ * @brief CPU pinning, NUMA memory binding and connection steering for the servers' request workers.
+ *
+ * On hosts with more than one socket, a request child or worker thread left to the scheduler can run on one node while its buffers were first touched, and so allocated, on another. Pinning each worker to one CPU keeps it and its memory together, binding its memory policy to that CPU's node keeps the kernel from placing pages elsewhere, and steering connections to the acceptor on the CPU that took the packet's interrupt keeps the socket's buffers on the node the NIC is attached to.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_AFFINITY_H
+#define OTP_AFFINITY_H
+
+#define AFFINITY_MAX_CPUS 1024
+
+int cpuListParse(const char* list, int* cpus, int max);
+int pinToCpu(int cpu, int bindMemory);
+int steerIncoming(int sock, int cpu);
+
+#endif
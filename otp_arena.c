@@ -0,0 +1,149 @@
+/**
+ * @file otp_arena.c
+ * @brief Per-worker arena that keeps request buffers mapped and warm from one request to the next.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <unistd.h>
+#include <sys/mman.h>
+#include "otp_stats.h"
+#include "otp_arena.h"
+
+// Huge page settings shared by every arena, fixed before the first allocation
+static size_t arenaHugeThreshold = 0;
+static int arenaPrefault = 0;
+
+/**
+ * @brief Sets how every arena maps large buffers.
+ *
+ * @param hugeThreshold Buffers of at least this many bytes are backed by huge pages, or 0 for never
+ * @param prefault Nonzero to fault in buffers of at least hugeThreshold bytes as they are mapped
+*/
+void arenaConfigure(size_t hugeThreshold, int prefault) {
+	arenaHugeThreshold = hugeThreshold;
+	arenaPrefault = prefault;
+}
+
+/**
+ * @brief Faults in every page of a new mapping, so requests using it do not.
+ *
+ * MADV_POPULATE_WRITE does this in one call where the kernel supports it. Otherwise every page is written once, which on a huge page region faults once per huge page.
+ *
+ * @param base The mapping
+ * @param size The size of the mapping
+*/
+static void prefault(char* base, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(base, size, MADV_POPULATE_WRITE))
+		return;
+#endif
+	size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < size; i += page)
+		base[i] = 0;
+}
+
+/**
+ * @brief Maps a region for a buffer of at least size bytes.
+ *
+ * Below the huge page threshold this is a plain anonymous mapping of whole pages. At or above it, the size is rounded up to whole huge pages and reserved huge pages are tried first with MAP_HUGETLB. Most hosts reserve none, so failing that the region is aligned to a huge page boundary and marked MADV_HUGEPAGE for transparent huge pages, which works whenever THP is enabled or set to madvise.
+ *
+ * @param size The number of bytes needed
+ * @param mapSize Set to the size of the mapping made
+ * @return The mapping, or NULL if there was no memory
+*/
+static char* arenaMap(size_t size, size_t* mapSize) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (!arenaHugeThreshold || size < arenaHugeThreshold) {
+		*mapSize = size < ARENA_MIN_SIZE ? ARENA_MIN_SIZE : (size + page - 1) / page * page;
+		char* base = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return base == MAP_FAILED ? NULL : base;
+	}
+	
+	// Reserved huge pages first
+	*mapSize = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+	int populate = arenaPrefault ? MAP_POPULATE : 0;
+	char* base = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+	if (base != MAP_FAILED)
+		return base;
+	
+	// Then transparent huge pages, trimming the mapping to a huge page boundary
+	char* raw = mmap(NULL, *mapSize + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	base = (char*)(((uintptr_t)raw + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+	if (base > raw)
+		munmap(raw, base - raw);
+	munmap(base + *mapSize, raw + ARENA_HUGE_PAGE - base);
+	madvise(base, *mapSize, MADV_HUGEPAGE);
+	if (arenaPrefault)
+		prefault(base, *mapSize);
+	return base;
+}
+
+/**
+ * @brief Hands out the next buffer of the arena, growing it to fit if needed.
+ *
+ * A buffer that is too small is replaced by a mapping of exactly the size asked for, rounded up to whole pages, or huge pages above the configured threshold, and at least ARENA_MIN_SIZE, so the arena tracks the high-water mark of recent requests rather than doubling past it. A new mapping counts as needed.
+ *
+ * @param arena The calling worker's arena
+ * @param size The number of bytes needed
+ * @return The buffer, page aligned and valid until the next reset, or NULL if the arena is out of buffers or memory
+*/
+void* arenaAlloc(struct arena* arena, size_t size) {
+	if (arena->used == ARENA_BUFFERS)
+		return NULL;
+	struct arenaBuffer* buffer = &arena->buffers[arena->used];
+	
+	// Replace a mapping too small for this request
+	if (size > buffer->size) {
+		if (buffer->base)
+			munmap(buffer->base, buffer->size);
+		size_t mapSize;
+		char* base = arenaMap(size, &mapSize);
+		if (!base) {
+			buffer->base = NULL;
+			buffer->size = 0;
+			return NULL;
+		}
+		buffer->base = base;
+		buffer->size = mapSize;
+	}
+	
+	// Mappings that keep being mostly needed stay, and the smallest ones stay as long as they are used at all
+	if (size > buffer->size / 2 || buffer->size == ARENA_MIN_SIZE)
+		buffer->neededAt = now();
+	arena->used++;
+	return buffer->base;
+}
+
+/**
+ * @brief Makes every buffer of the arena free for the next request, then trims it.
+ *
+ * @param arena The calling worker's arena
+ * @param idleMs How long a mapping may go without being mostly needed before it is returned to the OS
+*/
+void arenaReset(struct arena* arena, int idleMs) {
+	arena->used = 0;
+	arenaTrim(arena, idleMs);
+}
+
+/**
+ * @brief Returns to the OS every free mapping that no request has needed more than half of for the idle period.
+ *
+ * Workers call this when they find nothing to do, so an idle worker gives its memory back even if no request comes along to reset the arena.
+ *
+ * @param arena The calling worker's arena
+ * @param idleMs How long a mapping may go without being mostly needed before it is returned to the OS
+*/
+void arenaTrim(struct arena* arena, int idleMs) {
+	uint64_t time = now();
+	for (int i = arena->used; i < ARENA_BUFFERS; i++) {
+		struct arenaBuffer* buffer = &arena->buffers[i];
+		if (buffer->base && time - buffer->neededAt >= (uint64_t)idleMs * 1000000) {
+			munmap(buffer->base, buffer->size);
+			buffer->base = NULL;
+			buffer->size = 0;
+		}
+	}
+}
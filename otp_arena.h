@@ -0,0 +1,45 @@
+/**
+ * @file otp_arena.h
+ * @brief Per-worker arena that keeps request buffers mapped and warm from one request to the next.
+ *
+ * A request allocates its buffers in the same order every time, text then key, so the arena keeps one page-aligned mapping per position and hands the n-th allocation since the last reset the n-th mapping, growing it if it is too small. After the first few requests a worker's buffers are already mapped and faulted in, and a request costs no allocator calls or page faults. A mapping the worker has not needed most of for an idle period is returned to the OS, so one large request does not pin its memory forever.
+ *
+ * Multi-megabyte buffers can optionally be backed by 2 MB huge pages, which take one TLB entry and one page fault where 4 KB pages take 512 of each, and pre-faulted when mapped so the first request to use them does not pay for the faults.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_ARENA_H
+#define OTP_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_BUFFERS 4
+#define ARENA_MIN_SIZE (64 * 1024)
+#define ARENA_IDLE_MS 1000
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+/**
+ * @brief One mapping of the arena, and when a request last needed more than half of it.
+*/
+struct arenaBuffer {
+	char* base;
+	size_t size;
+	uint64_t neededAt;
+};
+
+/**
+ * @brief A worker's arena, valid when zeroed. Only the owning thread may use it.
+*/
+struct arena {
+	struct arenaBuffer buffers[ARENA_BUFFERS];
+	int used;
+};
+
+void arenaConfigure(size_t hugeThreshold, int prefault);
+void* arenaAlloc(struct arena* arena, size_t size);
+void arenaReset(struct arena* arena, int idleMs);
+void arenaTrim(struct arena* arena, int idleMs);
+
+#endif
@@ -0,0 +1,152 @@
+/**
+ * @file otp_budget.c
+ * @brief Server-wide memory budget for request buffers, shared by every request child.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "otp_budget.h"
+
+/**
+ * @brief Creates an empty budget in memory that stays shared with every child forked afterwards.
+ *
+ * The lock is process-shared and robust, so a child killed while holding it does not leave every other request waiting on it forever.
+ *
+ * @param limit The most bytes that may be reserved at once
+ * @return The new budget, or NULL if it could not be created
+*/
+struct budget* budgetCreate(int64_t limit) {
+	struct budget* budget = mmap(NULL, sizeof(struct budget), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (budget == MAP_FAILED)
+		return NULL;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	int failed = pthread_mutex_init(&budget->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (failed) {
+		munmap(budget, sizeof(struct budget));
+		return NULL;
+	}
+	budget->limit = limit;
+	budget->used = 0;
+	return budget;
+}
+
+/**
+ * @brief Locks the budget, first repairing it if the last holder of the lock died inside it.
+ *
+ * A child killed while holding the lock may have changed used but not its slot, or the other way round. Each slot, and unheld, is only changed by a single store, so used is rebuilt from them.
+ *
+ * @param budget The shared budget
+*/
+static void budgetLock(struct budget* budget) {
+	if (pthread_mutex_lock(&budget->lock) != EOWNERDEAD)
+		return;
+	int64_t used = budget->unheld;
+	for (int i = 0; i < BUDGET_HOLDERS; i++)
+		used += budget->holders[i].bytes;
+	budget->used = used;
+	pthread_mutex_consistent(&budget->lock);
+}
+
+/**
+ * @brief Finds where the bytes reserved through a slot are recorded.
+ *
+ * @param budget The shared budget
+ * @param slot A slot from budgetClaim(), or -1 for none
+ * @return The slot's byte count, or unheld for no slot
+*/
+static int64_t* budgetHeld(struct budget* budget, int slot) {
+	return slot >= 0 ? &budget->holders[slot].bytes : &budget->unheld;
+}
+
+/**
+ * @brief Reserves bytes from the budget for the holder of a slot, waiting up to a deadline for room.
+ *
+ * The check, the total and the holder's slot are all updated under the lock, so the budget is never overcommitted even when many children reserve at once, and a child killed at any point leaves its slot matching what it added to the total. While there is no room the caller polls every BUDGET_POLL_US, which costs nothing measurable next to the requests it is waiting on. A reservation larger than the whole budget fails at once.
+ *
+ * @param budget The shared budget
+ * @param slot The holder's slot from budgetClaim(), or -1 for none
+ * @param bytes The number of bytes to reserve
+ * @param waitMs How long to wait for room, in milliseconds
+ * @return 0 once reserved, or -1 if there was no room by the deadline
+*/
+int budgetReserve(struct budget* budget, int slot, int64_t bytes, int waitMs) {
+	if (bytes > budget->limit)
+		return -1;
+	int64_t* held = budgetHeld(budget, slot);
+	for (long waited = 0; ; waited += BUDGET_POLL_US) {
+		budgetLock(budget);
+		int fits = budget->used + bytes <= budget->limit;
+		if (fits) {
+			budget->used += bytes;
+			*held += bytes;
+		}
+		pthread_mutex_unlock(&budget->lock);
+		if (fits)
+			return 0;
+		if (waited >= waitMs * 1000L)
+			return -1;
+		usleep(BUDGET_POLL_US);
+	}
+}
+
+/**
+ * @brief Gives bytes reserved through a slot back to the budget.
+ *
+ * @param budget The shared budget
+ * @param slot The holder's slot from budgetClaim(), or -1 for none
+ * @param bytes The number of bytes to release, as earlier reserved through the same slot
+*/
+void budgetRelease(struct budget* budget, int slot, int64_t bytes) {
+	int64_t* held = budgetHeld(budget, slot);
+	budgetLock(budget);
+	budget->used -= bytes;
+	*held -= bytes;
+	pthread_mutex_unlock(&budget->lock);
+}
+
+/**
+ * @brief Claims a holder slot for a request child, so what it reserves can be reclaimed if it dies.
+ *
+ * @param budget The shared budget
+ * @param pid The child's process ID
+ * @return The slot, or -1 if every slot is taken, in which case the child's reservations cannot be reclaimed
+*/
+int budgetClaim(struct budget* budget, pid_t pid) {
+	for (int i = 0; i < BUDGET_HOLDERS; i++) {
+		pid_t free = 0;
+		if (__atomic_compare_exchange_n(&budget->holders[i].pid, &free, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Releases whatever a reaped child still held and frees its slot.
+ *
+ * This is called from the SIGCHLD handler. It takes the budget's lock, which is safe there because the thread handling SIGCHLD never reserves itself. Only request children and worker threads reserve, and workers block every signal.
+ *
+ * @param budget The shared budget
+ * @param pid The process ID of the reaped child
+ * @return The number of bytes released, 0 if the child held nothing or had no slot
+*/
+int64_t budgetReap(struct budget* budget, pid_t pid) {
+	for (int i = 0; i < BUDGET_HOLDERS; i++) {
+		if (__atomic_load_n(&budget->holders[i].pid, __ATOMIC_ACQUIRE) != pid)
+			continue;
+		budgetLock(budget);
+		int64_t bytes = budget->holders[i].bytes;
+		budget->holders[i].bytes = 0;
+		budget->used -= bytes;
+		pthread_mutex_unlock(&budget->lock);
+		__atomic_store_n(&budget->holders[i].pid, 0, __ATOMIC_RELEASE);
+		return bytes;
+	}
+	return 0;
+}
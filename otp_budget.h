@@ -0,0 +1,49 @@
+/**
+ * @file otp_budget.h
+ * @brief Server-wide memory budget for request buffers, shared by every request child.
+ *
+ * Each request reserves the bytes it is about to allocate before it reads a payload, and gives them back when it exits. A reservation that does not fit waits for others to be released, and gives up after a deadline so the request can be turned away instead of pushing the host into swap or the OOM killer.
+ *
+ * A request child also records what it holds in a slot of its own, so if it is killed before it can give its reservation back, the server can reclaim it when it reaps the child. The total and the holder's slot are changed together under a lock, so however a child dies, its slot says exactly what it held.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_BUDGET_H
+#define OTP_BUDGET_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BUDGET_POLL_US 1000
+#define BUDGET_HOLDERS 4096
+
+/**
+ * @brief A request child and the bytes it holds, 0 pid for a free slot.
+*/
+struct budgetHolder {
+	pid_t pid;
+	int64_t bytes;
+};
+
+/**
+ * @brief The budget, in memory shared with every child forked after it is created.
+ *
+ * used is always unheld plus the bytes of every holder, which is how it is rebuilt if a child dies holding the lock.
+*/
+struct budget {
+	pthread_mutex_t lock;
+	int64_t limit;
+	int64_t used;
+	int64_t unheld;
+	struct budgetHolder holders[BUDGET_HOLDERS];
+};
+
+struct budget* budgetCreate(int64_t limit);
+int budgetReserve(struct budget* budget, int slot, int64_t bytes, int waitMs);
+void budgetRelease(struct budget* budget, int slot, int64_t bytes);
+int budgetClaim(struct budget* budget, pid_t pid);
+int64_t budgetReap(struct budget* budget, pid_t pid);
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * @file otp_kernel.c
+ * @brief One-time pad transform kernels shared by the servers and otpbench.
+ *
+ * This file holds the scalar reference kernels the servers have always used, the table-driven kernels the servers use now, the table of every available kernel for otpbench to measure and cross-check, and parallelTransform(), which splits large requests across cores.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otp_kernel.h"
+
+/**
+ * @brief Encrypts len characters of text with the matching characters of key.
+ *
+ * Each character is mapped to its value (A-Z as 0-25, space as 26), the text and key values are added modulo 27, and the sum is mapped back to a character. This is the reference every other encryption kernel is checked against.
+ *
+ * @param text The plaintext to encrypt.
+ * @param key The key to encrypt with, at least len characters long.
+ * @param result The buffer to write the ciphertext to, at least len characters long.
+ * @param len The number of characters to encrypt.
+*/
+void encryptScalar(const char* text, const char* key, char* result, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		int txtVal = text[i] == ' ' ? 26 : text[i] - 'A';
+		int keyVal = key[i] == ' ' ? 26 : key[i] - 'A';
+		int encVal = (txtVal + keyVal) % 27;
+		result[i] = encVal == 26 ? ' ' : encVal + 'A';
+	}
+}
+
+/**
+ * @brief Decrypts len characters of ciphertext with the matching characters of key.
+ *
+ * Each character is mapped to its value (A-Z as 0-25, space as 26), the key value is subtracted from the ciphertext value modulo 27, and the difference is mapped back to a character. This is the reference every other decryption kernel is checked against.
+ *
+ * @param enc The ciphertext to decrypt.
+ * @param key The key to decrypt with, at least len characters long.
+ * @param result The buffer to write the plaintext to, at least len characters long.
+ * @param len The number of characters to decrypt.
+*/
+void decryptScalar(const char* enc, const char* key, char* result, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		int encVal = enc[i] == ' ' ? 26 : enc[i] - 'A';
+		int keyVal = key[i] == ' ' ? 26 : key[i] - 'A';
+		int txtVal = abs(encVal - keyVal + 27) % 27;
+		result[i] = txtVal == 26 ? ' ' : txtVal + 'A';
+	}
+}
+
+// Every symbol of the alphabet with its value, for building the lookup tables
+#define SYMBOLS(f) f('A', 0) f('B', 1) f('C', 2) f('D', 3) f('E', 4) f('F', 5) f('G', 6) f('H', 7) f('I', 8) \
+	f('J', 9) f('K', 10) f('L', 11) f('M', 12) f('N', 13) f('O', 14) f('P', 15) f('Q', 16) f('R', 17) \
+	f('S', 18) f('T', 19) f('U', 20) f('V', 21) f('W', 22) f('X', 23) f('Y', 24) f('Z', 25) f(' ', 26)
+#define SYMBOL_VALUE(c, v) [(unsigned char)c] = v,
+#define SYMBOL_NEGATED(c, v) [(unsigned char)c] = 27 - v,
+
+// The value of every byte, and 27 minus it, with bytes outside the alphabet as 0
+static const unsigned char symbolValue[256] = {SYMBOLS(SYMBOL_VALUE)};
+static const unsigned char symbolNegated[256] = {SYMBOLS(SYMBOL_NEGATED)};
+
+// The symbol for every sum of two values from 0 to 53, which is the alphabet twice
+static const char symbolOf[54] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+/**
+ * @brief Encrypts len characters of text with the matching characters of key using lookup tables.
+ *
+ * Both characters are mapped to their values through a 256-entry table, and their sum, at most 52, indexes a 54-entry table holding the alphabet twice, which does the modulo. There are no branches, and no table index can go out of bounds whatever bytes arrive, though only the 27 symbols of the alphabet give the same output as encryptScalar(). This is the portable kernel the servers use.
+ *
+ * @param text The plaintext to encrypt.
+ * @param key The key to encrypt with, at least len characters long.
+ * @param result The buffer to write the ciphertext to, at least len characters long.
+ * @param len The number of characters to encrypt.
+*/
+void encryptTable(const char* text, const char* key, char* result, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		result[i] = symbolOf[symbolValue[(unsigned char)text[i]] + symbolValue[(unsigned char)key[i]]];
+}
+
+/**
+ * @brief Decrypts len characters of ciphertext with the matching characters of key using lookup tables.
+ *
+ * As encryptTable(), but the key is mapped through a table of 27 minus its value, so the sum runs from 1 to 53 and the subtraction needs no abs() or modulo.
+ *
+ * @param enc The ciphertext to decrypt.
+ * @param key The key to decrypt with, at least len characters long.
+ * @param result The buffer to write the plaintext to, at least len characters long.
+ * @param len The number of characters to decrypt.
+*/
+void decryptTable(const char* enc, const char* key, char* result, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		result[i] = symbolOf[symbolValue[(unsigned char)enc[i]] + symbolNegated[(unsigned char)key[i]]];
+}
+
+const struct kernelInfo kernels[] = {
+	{"scalar", encryptScalar, decryptScalar},
+	{"table", encryptTable, decryptTable},
+};
+
+const int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
+
+/**
+ * @brief One range of a request handled by transformSlice() in parallelTransform().
+*/
+struct slice {
+	otpKernel kernel;
+	const char* text;
+	const char* key;
+	char* result;
+	size_t len;
+};
+
+/**
+ * @brief Thread entry point that runs a kernel over a single slice.
+ *
+ * @param arg A pointer to the slice to transform
+ * @return NULL
+*/
+static void* transformSlice(void* arg) {
+	struct slice* slice = arg;
+	slice->kernel(slice->text, slice->key, slice->result, slice->len);
+	return NULL;
+}
+
+/**
+ * @brief Runs a kernel over a request, splitting large requests across all online cores.
+ *
+ * Requests shorter than PARALLEL_THRESHOLD are transformed on the calling thread, since starting threads would cost more than it saves. Larger requests are cut into one slice per core the calling thread may run on, each at least PARALLEL_MIN_SLICE characters and aligned to a 64 byte cache line so no two threads write to the same line of the result. The calling thread transforms the last slice itself while the others run.
+ *
+ * Slice threads inherit the caller's CPU affinity, so a caller pinned to one core, such as a threaded server worker or a child pinned with -P, runs the whole kernel inline rather than starting threads that would all share its core.
+ *
+ * @param kernel The kernel to run.
+ * @param text The text to transform.
+ * @param key The key to transform with, at least len characters long.
+ * @param result The buffer to write the output to, at least len characters long.
+ * @param len The number of characters to transform.
+*/
+void parallelTransform(otpKernel kernel, const char* text, const char* key, char* result, size_t len) {
+	// Work out how many threads the request is worth, and how many cores the caller may use
+	if (len < PARALLEL_THRESHOLD) {
+		kernel(text, key, result, len);
+		return;
+	}
+	cpu_set_t allowed;
+	long count = sched_getaffinity(0, sizeof(allowed), &allowed) < 0 ? sysconf(_SC_NPROCESSORS_ONLN) : CPU_COUNT(&allowed);
+	if (count > (long)(len / PARALLEL_MIN_SLICE))
+		count = len / PARALLEL_MIN_SLICE;
+	if (count > PARALLEL_MAX_THREADS)
+		count = PARALLEL_MAX_THREADS;
+	if (count < 2) {
+		kernel(text, key, result, len);
+		return;
+	}
+	
+	// Size slices to cover the request in count cache line aligned pieces
+	size_t sliceLen = ((len + count - 1) / count + 63) & ~(size_t)63;
+	struct slice slices[PARALLEL_MAX_THREADS];
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	int started = 0;
+	size_t offset = 0;
+	
+	// Start a thread for every slice but the last
+	for (; len - offset > sliceLen; offset += sliceLen) {
+		slices[started] = (struct slice) {kernel, text + offset, key + offset, result + offset, sliceLen};
+		if (pthread_create(&threads[started], NULL, transformSlice, &slices[started]))
+			break;
+		started++;
+	}
+	
+	// Transform whatever is left here, then wait for the rest
+	kernel(text + offset, key + offset, result + offset, len - offset);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file otp_kernel.h
+ * @brief One-time pad transform kernels shared by the servers and otpbench.
+ *
+ * A kernel transforms len characters of text with the matching characters of key into result, mapping A-Z to 0-25 and space to 26 and working modulo 27. Every kernel must produce exactly the same output as the scalar reference kernels, encryptScalar() and decryptScalar(), for text and key drawn from that 27 symbol alphabet, must stay in bounds for any other bytes, and must allow result to be the same buffer as text.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_KERNEL_H
+#define OTP_KERNEL_H
+
+#include <stddef.h>
+
+#define PARALLEL_THRESHOLD (1 << 20)
+#define PARALLEL_MIN_SLICE (1 << 18)
+#define PARALLEL_MAX_THREADS 64
+
+/**
+ * @brief A function that encrypts or decrypts len characters of text with key into result.
+*/
+typedef void (*otpKernel)(const char* text, const char* key, char* result, size_t len);
+
+/**
+ * @brief A named pair of encryption and decryption kernels.
+*/
+struct kernelInfo {
+	const char* name;
+	otpKernel encrypt;
+	otpKernel decrypt;
+};
+
+/**
+ * @brief Every available kernel pair, with the scalar reference first.
+*/
+extern const struct kernelInfo kernels[];
+
+/**
+ * @brief The number of entries in kernels.
+*/
+extern const int kernelCount;
+
+void encryptScalar(const char* text, const char* key, char* result, size_t len);
+void decryptScalar(const char* enc, const char* key, char* result, size_t len);
+void encryptTable(const char* text, const char* key, char* result, size_t len);
+void decryptTable(const char* enc, const char* key, char* result, size_t len);
+void parallelTransform(otpKernel kernel, const char* text, const char* key, char* result, size_t len);
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * @file otp_log.c
+ * @brief Asynchronous access log for the servers, fed through a lock-free ring in shared memory.
+ *
+ * The ring is a bounded queue in the style of Dmitry Vyukov's: every cell carries a sequence number, so producers can claim a cell with a single compare-and-swap on head and the consumer can tell a filled cell from one still being written without any lock.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include "otp_log.h"
+
+/**
+ * @brief Formats one record as a line of the access log.
+ *
+ * @param out The stream to write to
+ * @param record The record to format
+*/
+static void logFormat(FILE* out, const struct logRecord* record) {
+	// Timestamp in UTC with microseconds
+	time_t seconds = record->time / 1000000000;
+	struct tm utc;
+	gmtime_r(&seconds, &utc);
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+	
+	// Peer, op & outcome, then every phase in microseconds
+	struct in_addr peer = {record->peerAddr};
+	fprintf(out, "%s.%06uZ %s:%u %.3s pid=%u len=%u result=%d", stamp, (unsigned)(record->time / 1000 % 1000000),
+		inet_ntoa(peer), ntohs(record->peerPort), record->op, record->pid, record->len, record->result);
+	for (int i = 0; i < PHASE_COUNT; i++)
+		fprintf(out, " %s=%.1f", phaseNames[i], record->phases[i] / 1e3);
+	fputc('\n', out);
+}
+
+/**
+ * @brief Frees the cell at tail if a producer claimed it but has not published it for LOG_STALL_MS.
+ *
+ * Request children can be killed at any point, and one killed between claiming a cell and publishing it would otherwise hold up every record behind it until the ring filled. The cell is freed for its next lap with compare-and-swap and counted as dropped. A producer that was only slow then fails to publish and its record is lost with the cell.
+ *
+ * @param ring The shared ring
+ * @param stalledSince When the cell at tail was first seen claimed but unpublished, or 0 if it has not been, kept by the caller
+*/
+static void logSkipStalled(struct logRing* ring, uint64_t* stalledSince) {
+	// Nothing claimed, so nothing to wait for
+	uint64_t tail = ring->tail;
+	if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail) {
+		*stalledSince = 0;
+		return;
+	}
+	
+	// Start timing the cell, then give up on it once it has waited long enough
+	uint64_t time = now();
+	if (!*stalledSince)
+		*stalledSince = time;
+	if (time - *stalledSince < LOG_STALL_MS * 1000000ULL)
+		return;
+	*stalledSince = 0;
+	uint64_t claimed = tail;
+	if (__atomic_compare_exchange_n(&ring->cells[tail % LOG_SLOTS].sequence, &claimed, tail + LOG_SLOTS, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Drains the ring into the log file until the server exits.
+ *
+ * Records are formatted into the stream's buffer and flushed once per batch of up to LOG_BATCH, so the file sees a few large writes rather than one per request. When the ring is empty the logger sleeps for LOG_IDLE_US, and it notes in the log whenever records have been dropped since it last looked. A cell left unpublished by a producer that died is skipped by logSkipStalled().
+ *
+ * @param ring The shared ring
+ * @param out The log file
+*/
+static void logDrain(struct logRing* ring, FILE* out) {
+	uint64_t reported = 0, stalledSince = 0;
+	while (1) {
+		// Consume filled cells in order, up to a batch
+		int taken = 0;
+		for (; taken < LOG_BATCH; taken++) {
+			struct logCell* cell = &ring->cells[ring->tail % LOG_SLOTS];
+			if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != ring->tail + 1)
+				break;
+			logFormat(out, &cell->record);
+			__atomic_store_n(&cell->sequence, ring->tail + LOG_SLOTS, __ATOMIC_RELEASE);
+			__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELAXED);
+		}
+		if (taken)
+			stalledSince = 0;
+		else
+			logSkipStalled(ring, &stalledSince);
+	
+		// Note any drops since last time
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			fprintf(out, "# %llu record(s) dropped, log ring full or record abandoned\n", (unsigned long long)(dropped - reported));
+			reported = dropped;
+		}
+	
+		// Write batch out, or wait for more
+		fflush(out);
+		if (!taken)
+			usleep(LOG_IDLE_US);
+	}
+}
+
+/**
+ * @brief Creates the shared log ring and forks the logger process that drains it into a file.
+ *
+ * The file is opened before forking so a bad path fails at startup. The logger exits along with the server, and its process ID is kept in the ring.
+ *
+ * @param path The access log file to append to
+ * @return The shared ring, or NULL if the file, the ring or the logger could not be created
+*/
+struct logRing* logCreate(const char* path) {
+	// Open log file with a large buffer for batching
+	FILE* out = fopen(path, "a");
+	if (!out)
+		return NULL;
+	setvbuf(out, NULL, _IOFBF, 1 << 16);
+	
+	// Map ring shared & mark every cell free for its first lap
+	struct logRing* ring = mmap(NULL, sizeof(struct logRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		fclose(out);
+		return NULL;
+	}
+	for (uint64_t i = 0; i < LOG_SLOTS; i++)
+		ring->cells[i].sequence = i;
+	
+	// Fork logger, which dies with the server
+	pid_t pid = fork();
+	if (pid < 0) {
+		fclose(out);
+		munmap(ring, sizeof(struct logRing));
+		return NULL;
+	}
+	if (!pid) {
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		signal(SIGUSR1, SIG_IGN);
+		logDrain(ring, out);
+	}
+	ring->logger = pid;
+	fclose(out);
+	return ring;
+}
+
+/**
+ * @brief Pushes a record into the ring without blocking.
+ *
+ * A producer claims the cell at head once its sequence shows it is free for this lap, by moving head on with compare-and-swap, then copies the record in and publishes it by advancing the sequence, also with compare-and-swap in case the logger has given up on the cell in the meantime. If the cell at head is still waiting for the logger the ring is full, and the record is dropped and counted instead.
+ *
+ * @param ring The shared ring
+ * @param record The record to push
+*/
+void logPush(struct logRing* ring, const struct logRecord* record) {
+	uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (1) {
+		struct logCell* cell = &ring->cells[pos % LOG_SLOTS];
+		int64_t diff = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+	
+		// Free for this lap, try to claim it
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				cell->record = *record;
+				uint64_t claimed = pos;
+				__atomic_compare_exchange_n(&cell->sequence, &claimed, pos + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+				return;
+			}
+		}
+	
+		// Still holding last lap's record, the ring is full
+		else if (diff < 0) {
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	
+		// Another producer got there first, catch up
+		else {
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * @brief Builds the access log record for a request from its trace and pushes it into the ring.
+ *
+ * The record's total is measured up to now, so requests cut short by an error still show how long they ran.
+ *
+ * @param ring The shared ring
+ * @param trace The request's trace
+ * @param peer The client's address
+ * @param op The operation, "enc" or "dec"
+ * @param result 0 if the request succeeded, or the exit code it failed with
+*/
+void logRequest(struct logRing* ring, const struct trace* trace, const struct sockaddr_in* peer, const char* op, int result) {
+	struct logRecord record;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	record.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	record.peerAddr = peer->sin_addr.s_addr;
+	record.peerPort = peer->sin_port;
+	memcpy(record.op, op, sizeof(record.op));
+	record.result = result;
+	record.pid = trace->pid;
+	record.len = trace->len;
+	memcpy(record.phases, trace->phases, sizeof(record.phases));
+	record.phases[PHASE_TOTAL] = now() - trace->start;
+	logPush(ring, &record);
+}
@@ -0,0 +1,61 @@
+/**
+ * @file otp_log.h
+ * @brief Asynchronous access log for the servers, fed through a lock-free ring in shared memory.
+ *
+ * Request children never format or write log lines themselves. Each pushes one fixed-size binary record into a multi-producer, single-consumer ring shared with a logger process, which formats and writes records in batches. If the ring is full the record is dropped and counted rather than making the request wait.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_LOG_H
+#define OTP_LOG_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "otp_stats.h"
+
+#define LOG_SLOTS 4096
+#define LOG_BATCH 256
+#define LOG_IDLE_US 10000
+#define LOG_STALL_MS 1000
+
+/**
+ * @brief One access log entry, as pushed by a request child.
+*/
+struct logRecord {
+	uint64_t time;
+	uint32_t peerAddr;
+	uint16_t peerPort;
+	char op[4];
+	int16_t result;
+	uint32_t pid;
+	uint32_t len;
+	uint64_t phases[PHASE_COUNT];
+};
+
+/**
+ * @brief A ring slot. sequence says whose turn the slot is: equal to a producer's position when free, one past it once filled.
+*/
+struct logCell {
+	uint64_t sequence;
+	struct logRecord record;
+};
+
+/**
+ * @brief The ring shared by every request child and the logger process.
+ *
+ * head is claimed by producers with compare-and-swap, tail is only moved by the logger, and each sits on its own cache line.
+*/
+struct logRing {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t dropped __attribute__((aligned(64)));
+	pid_t logger;
+	struct logCell cells[LOG_SLOTS];
+};
+
+struct logRing* logCreate(const char* path);
+void logPush(struct logRing* ring, const struct logRecord* record);
+void logRequest(struct logRing* ring, const struct trace* trace, const struct sockaddr_in* peer, const char* op, int result);
+
+#endif
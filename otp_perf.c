@@ -0,0 +1,106 @@
+/**
+ * @file otp_perf.c
+ * @brief Hardware performance counters around the transform kernel.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "otp_perf.h"
+
+static const uint64_t perfConfigs[PERF_EVENT_COUNT] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/**
+ * @brief Opens the counters for the calling thread, disabled.
+ *
+ * Each counter is opened on its own with inherit set, rather than as a group, so threads started by parallelTransform() are counted too. The kernel folds a thread's counts into these as the thread exits, but that can happen just after pthread_join() has returned, so the counts of a transform split across threads are approximate and can come up short. A caller pinned to one core runs the transform inline, and its counts are exact. Only user-space events are counted, which works at perf_event_paranoid 2.
+ *
+ * @param counters The counters to open
+ * @return 0 on success, or -1 if any counter could not be opened
+*/
+int perfOpen(struct perfCounters* counters) {
+	for (int i = 0; i < PERF_EVENT_COUNT; i++)
+		counters->fds[i] = -1;
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = perfConfigs[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (counters->fds[i] < 0) {
+			perfClose(counters);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Zeroes and starts the counters.
+ *
+ * @param counters Open counters
+*/
+void perfStart(struct perfCounters* counters) {
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/**
+ * @brief Stops the counters and reads their values.
+ *
+ * Call this only after every slice thread of the transform has been joined. Even then, a slice thread's counts may still be on their way in, as perfOpen() describes.
+ *
+ * @param counters Running counters, whose values are filled in
+*/
+void perfStop(struct perfCounters* counters) {
+	for (int i = 0; i < PERF_EVENT_COUNT; i++)
+		ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	for (int i = 0; i < PERF_EVENT_COUNT; i++)
+		if (read(counters->fds[i], &counters->values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+			counters->values[i] = 0;
+}
+
+/**
+ * @brief Closes any open counters.
+ *
+ * @param counters The counters to close
+*/
+void perfClose(struct perfCounters* counters) {
+	for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+		if (counters->fds[i] >= 0)
+			close(counters->fds[i]);
+		counters->fds[i] = -1;
+	}
+}
+
+/**
+ * @brief Adds one transform's counts to the stats block, under the power of two size bucket of its length.
+ *
+ * @param stats The shared stats block
+ * @param counters Stopped counters holding the transform's counts
+ * @param len The number of characters transformed
+*/
+void perfRecord(struct stats* stats, const struct perfCounters* counters, uint64_t len) {
+	int b = len ? 63 - __builtin_clzll(len) : 0;
+	struct perfBucket* bucket = &stats->perf[b < PERF_BUCKETS ? b : PERF_BUCKETS - 1];
+	__atomic_fetch_add(&bucket->samples, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bucket->bytes, len, __ATOMIC_RELAXED);
+	for (int i = 0; i < PERF_EVENT_COUNT; i++)
+		__atomic_fetch_add(&bucket->events[i], counters->values[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+/**
+ * @file otp_perf.h
+ * @brief Hardware performance counters around the transform kernel.
+ *
+ * With counters enabled, each request's transform is bracketed by cycles, instructions, cache miss and branch miss counters from perf_event_open(), and the counts are added to the stats block by request size, so cycles per byte and IPC can be compared across sizes. Counts for transforms split across threads are approximate, see perfOpen().
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_PERF_H
+#define OTP_PERF_H
+
+#include <stdint.h>
+#include "otp_stats.h"
+
+/**
+ * @brief An open set of counters for the calling thread and any threads it starts.
+*/
+struct perfCounters {
+	int fds[PERF_EVENT_COUNT];
+	uint64_t values[PERF_EVENT_COUNT];
+};
+
+int perfOpen(struct perfCounters* counters);
+void perfStart(struct perfCounters* counters);
+void perfStop(struct perfCounters* counters);
+void perfClose(struct perfCounters* counters);
+void perfRecord(struct stats* stats, const struct perfCounters* counters, uint64_t len);
+
+#endif
@@ -0,0 +1,190 @@
+/**
+ * @file otp_pool.c
+ * @brief Thread-per-core worker pool with work-stealing connection deques, for the servers' threaded mode.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "otp_stats.h"
+#include "otp_affinity.h"
+#include "otp_pool.h"
+
+/**
+ * @brief One worker thread, the CPU it runs on and the deque it owns.
+*/
+struct worker {
+	int id;
+	int cpu;
+	struct deque deque;
+};
+
+// Settings shared by every worker, fixed before the first one starts
+static int poolListenSock;
+static int poolWorkers;
+static int poolBindMemory;
+static poolHandler poolHandle;
+static poolIdler poolIdle;
+static struct worker* workers;
+
+/**
+ * @brief Adds a connection at the bottom of the owner's deque.
+ *
+ * @param deque The calling worker's own deque
+ * @param conn The connection to add
+ * @return 0 on success, or -1 if the deque is full
+*/
+static int dequePush(struct deque* deque, struct poolConn* conn) {
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	if (bottom - top >= POOL_DEQUE_SIZE)
+		return -1;
+	__atomic_store_n(&deque->conns[bottom % POOL_DEQUE_SIZE], conn, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * @brief Takes the oldest connection from the top of a deque, racing any other worker doing the same.
+ *
+ * @param deque The deque to take from, the caller's own or another's
+ * @return The connection, or NULL if the deque was empty or another worker took it first
+*/
+static struct poolConn* dequeSteal(struct deque* deque) {
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom)
+		return NULL;
+	struct poolConn* conn = __atomic_load_n(&deque->conns[top % POOL_DEQUE_SIZE], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return conn;
+}
+
+/**
+ * @brief Accepts every connection waiting on the listening socket into the worker's own deque.
+ *
+ * The listening socket is non-blocking, so this stops as soon as the kernel queue is empty, or the deque is full.
+ *
+ * @param worker The calling worker
+*/
+static void acceptAll(struct worker* worker) {
+	while (1) {
+		struct poolConn* conn = malloc(sizeof(struct poolConn));
+		if (!conn)
+			return;
+		socklen_t clientSize = sizeof(conn->client);
+		conn->sock = accept4(poolListenSock, (struct sockaddr*)&conn->client, &clientSize, SOCK_CLOEXEC);
+		if (conn->sock < 0) {
+			free(conn);
+			return;
+		}
+		conn->acceptTime = now();
+		if (dequePush(&worker->deque, conn) < 0) {
+			poolHandle(conn->sock, &conn->client, conn->acceptTime);
+			free(conn);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Thread entry point for a worker, which never returns.
+ *
+ * A worker first pins itself to its CPU, binding its memory to the CPU's node if asked to. Placement is best effort, a worker that cannot be pinned still serves connections. It then serves its own deque first, then tries to steal from every other worker starting from the next one along, and only when nothing can be found anywhere runs the idle hook and waits up to POOL_IDLE_MS for new connections. The timeout bounds how long a burst accepted by a busy worker can sit before an idle one notices it.
+ *
+ * @param arg The worker
+ * @return Does not return
+*/
+static void* runWorker(void* arg) {
+	struct worker* worker = arg;
+	pinToCpu(worker->cpu, poolBindMemory);
+	struct pollfd listenPoll = {poolListenSock, POLLIN, 0};
+	while (1) {
+		// Own connections first, oldest first
+		acceptAll(worker);
+		struct poolConn* conn = dequeSteal(&worker->deque);
+		
+		// Then anyone else's
+		for (int i = 1; !conn && i < poolWorkers; i++)
+			conn = dequeSteal(&workers[(worker->id + i) % poolWorkers].deque);
+		
+		// Serve the connection, or wait for one
+		if (conn) {
+			poolHandle(conn->sock, &conn->client, conn->acceptTime);
+			free(conn);
+		} else {
+			if (poolIdle)
+				poolIdle();
+			poll(&listenPoll, 1, POOL_IDLE_MS);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Starts the worker threads, each pinned to one of the CPUs the server may run on.
+ *
+ * Workers are pinned in turn to the CPUs of the process's affinity mask, wrapping around if there are more workers than CPUs. SIGPIPE is ignored, since a client hanging up must not take the whole server down, and every other signal is blocked in the workers so the calling thread is the one to handle them. The listening socket is made non-blocking so workers can drain it.
+ *
+ * @param listenSock The listening socket to accept connections from
+ * @param workerCount The number of workers, or 0 for one per CPU
+ * @param bindMemory Nonzero to bind each worker's memory to the NUMA node of its CPU
+ * @param handle The function that handles each connection
+ * @param idle The function a worker calls when it has nothing to do, or NULL
+ * @return 0 once every worker is running, or -1 if they could not be started
+*/
+int poolStart(int listenSock, int workerCount, int bindMemory, poolHandler handle, poolIdler idle) {
+	// Find the CPUs to pin to
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+	int cpus[CPU_SETSIZE], cpuCount = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed))
+			cpus[cpuCount++] = cpu;
+	if (!workerCount)
+		workerCount = cpuCount;
+	if (workerCount > POOL_MAX_WORKERS)
+		workerCount = POOL_MAX_WORKERS;
+	
+	// Set up shared state & workers
+	poolListenSock = listenSock;
+	poolWorkers = workerCount;
+	poolBindMemory = bindMemory;
+	poolHandle = handle;
+	poolIdle = idle;
+	workers = aligned_alloc(64, workerCount * sizeof(struct worker));
+	if (!workers)
+		return -1;
+	fcntl(listenSock, F_SETFL, fcntl(listenSock, F_GETFL) | O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Start workers with every signal blocked, then restore the caller's mask
+	sigset_t all, saved;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (int i = 0; i < workerCount; i++) {
+		workers[i].id = i;
+		workers[i].cpu = cpus[i % cpuCount];
+		workers[i].deque.top = workers[i].deque.bottom = 0;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, runWorker, &workers[i])) {
+			pthread_sigmask(SIG_SETMASK, &saved, NULL);
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return 0;
+}
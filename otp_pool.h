@@ -0,0 +1,50 @@
+/**
+ * @file otp_pool.h
+ * @brief Thread-per-core worker pool with work-stealing connection deques, for the servers' threaded mode.
+ *
+ * Every worker is pinned to a CPU and owns a Chase-Lev deque of accepted connections. A worker that wakes to find connections waiting accepts all of them into its own deque, and any idle worker steals from the others, so a burst landing on one worker spreads across the cores without a shared lock or a fork per connection.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_POOL_H
+#define OTP_POOL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define POOL_DEQUE_SIZE 1024
+#define POOL_IDLE_MS 1
+#define POOL_MAX_WORKERS 256
+
+/**
+ * @brief An accepted connection waiting for a worker.
+*/
+struct poolConn {
+	int sock;
+	struct sockaddr_in client;
+	uint64_t acceptTime;
+};
+
+/**
+ * @brief A Chase-Lev work-stealing deque. Only the owning worker pushes at bottom, and every worker, the owner included, takes from top, so connections are served in the order they were accepted.
+*/
+struct deque {
+	int64_t top __attribute__((aligned(64)));
+	int64_t bottom __attribute__((aligned(64)));
+	struct poolConn* conns[POOL_DEQUE_SIZE] __attribute__((aligned(64)));
+};
+
+/**
+ * @brief Handles one connection on a worker thread, and closes it.
+*/
+typedef void (*poolHandler)(int sock, const struct sockaddr_in* client, uint64_t acceptTime);
+
+/**
+ * @brief Called on a worker thread each time it finds nothing to do, before it waits for connections.
+*/
+typedef void (*poolIdler)(void);
+
+int poolStart(int listenSock, int workers, int bindMemory, poolHandler handle, poolIdler idle);
+
+#endif
@@ -0,0 +1,35 @@
+/**
+ * @file otp_probes.h
+ * @brief Static user-space tracepoints (USDT) for perf and bpftrace.
+ *
+ * When <sys/sdt.h> is available (systemtap-sdt-dev on Debian, systemtap-sdt-devel on Fedora), each OTP_PROBE macro places a single nop in the code and records its location and arguments in an ELF note. Tools such as `perf probe sdt_otp:*` or `bpftrace -e 'usdt:./enc_server:otp:transform_return { ... }'` patch the nop into a trap only while attached, so unattached probes cost nothing. Without the header, or when built with -DOTP_NO_USDT, the macros compile to nothing at all.
+ *
+ * Probes, all in the "otp" provider:
+ *   validate_entry(sock), validate_return(sock, accepted)
+ *   receive_entry(sock), receive_return(sock, len)
+ *   send_entry(sock, len), send_return(sock, len)
+ *   request_entry(sock), request_return(sock, len)
+ *   transform_entry(len), transform_return(len)
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_PROBES_H
+#define OTP_PROBES_H
+
+#if !defined(OTP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define OTP_USDT 1
+#endif
+#endif
+
+#ifdef OTP_USDT
+#include <sys/sdt.h>
+#define OTP_PROBE1(name, a) DTRACE_PROBE1(otp, name, a)
+#define OTP_PROBE2(name, a, b) DTRACE_PROBE2(otp, name, a, b)
+#else
+#define OTP_PROBE1(name, a) do {} while (0)
+#define OTP_PROBE2(name, a, b) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * @file otp_sched.c
+ * @brief Shortest-job-first admission for the servers' accept loop.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "otp_sched.h"
+
+/**
+ * @brief Creates a scheduler for connections on a listening socket.
+ *
+ * @param listenSock The listening socket to accept connections from
+ * @param hello The 4 byte validation message clients must send, and that is sent back, "enc" or "dec"
+ * @param stats The shared stats block, for counting rejected handshakes
+ * @param maxConns The most connections held in the handshake or the queue at once
+ * @return The new scheduler, or NULL if it could not be allocated
+*/
+struct sched* schedCreate(int listenSock, const char* hello, struct stats* stats, int maxConns) {
+	struct sched* sched = calloc(1, sizeof(struct sched));
+	if (!sched)
+		return NULL;
+	sched->listenSock = listenSock;
+	memcpy(sched->hello, hello, sizeof(sched->hello));
+	sched->stats = stats;
+	sched->maxConns = maxConns;
+	sched->pending = malloc(maxConns * sizeof(struct pendingConn));
+	sched->fds = malloc((maxConns + 1) * sizeof(struct pollfd));
+	sched->jobs = malloc(maxConns * sizeof(struct job));
+	if (!sched->pending || !sched->fds || !sched->jobs) {
+		free(sched->pending);
+		free(sched->fds);
+		free(sched->jobs);
+		free(sched);
+		return NULL;
+	}
+	return sched;
+}
+
+/**
+ * @brief Adds a job to the queue, sifting it up the binary heap.
+ *
+ * @param sched The scheduler
+ * @param job The job to add
+*/
+static void schedPush(struct sched* sched, const struct job* job) {
+	int i = sched->jobCount++;
+	while (i > 0 && sched->jobs[(i - 1) / 2].key > job->key) {
+		sched->jobs[i] = sched->jobs[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	sched->jobs[i] = *job;
+}
+
+/**
+ * @brief Takes the job with the smallest key off the queue.
+ *
+ * @param sched The scheduler
+ * @param job Set to the job taken
+ * @return 1 if a job was taken, or 0 if the queue is empty
+*/
+int schedNext(struct sched* sched, struct job* job) {
+	if (!sched->jobCount)
+		return 0;
+	*job = sched->jobs[0];
+	
+	// Sift the last job down from the root
+	struct job last = sched->jobs[--sched->jobCount];
+	int i = 0;
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= sched->jobCount)
+			break;
+		if (child + 1 < sched->jobCount && sched->jobs[child + 1].key < sched->jobs[child].key)
+			child++;
+		if (sched->jobs[child].key >= last.key)
+			break;
+		sched->jobs[i] = sched->jobs[child];
+		i = child;
+	}
+	sched->jobs[i] = last;
+	return 1;
+}
+
+/**
+ * @brief Moves a pending connection on as far as the data it has sent allows.
+ *
+ * Once the whole hello is in, the server's own hello is sent back, as validate() would, and a client of the wrong kind is dropped. Once the first frame length can be peeked, the connection is queued with that length. Nothing here blocks, so a slow client only holds up itself.
+ *
+ * @param sched The scheduler
+ * @param conn The pending connection
+ * @return 1 if the connection is done with, queued or dropped, or 0 if it is still pending
+*/
+static int schedAdvance(struct sched* sched, struct pendingConn* conn) {
+	// Read the rest of the hello & answer it
+	if (conn->helloLen < (int)sizeof(conn->hello)) {
+		ssize_t charsRead = recv(conn->sock, conn->hello + conn->helloLen, sizeof(conn->hello) - conn->helloLen, MSG_DONTWAIT);
+		if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (charsRead <= 0) {
+			close(conn->sock);
+			return 1;
+		}
+		conn->helloLen += charsRead;
+		if (conn->helloLen < (int)sizeof(conn->hello))
+			return 0;
+		send(conn->sock, sched->hello, sizeof(sched->hello), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (memcmp(conn->hello, sched->hello, sizeof(sched->hello))) {
+			statsCount(sched->stats, COUNTER_REJECTED, 1);
+			statsCount(sched->stats, COUNTER_ERRORS, 1);
+			close(conn->sock);
+			return 1;
+		}
+	}
+	
+	// Peek the first frame length & queue by it
+	int len;
+	ssize_t charsRead = recv(conn->sock, &len, sizeof(len), MSG_PEEK | MSG_DONTWAIT);
+	if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (charsRead <= 0) {
+		close(conn->sock);
+		return 1;
+	}
+	if (charsRead < (ssize_t)sizeof(len))
+		return 0;
+	struct job job = {(len < 0 ? SCHED_STREAM_COST : (uint64_t)len) + conn->acceptTime / SCHED_AGING_NS, conn->sock, conn->client, conn->acceptTime};
+	schedPush(sched, &job);
+	return 1;
+}
+
+/**
+ * @brief Waits for activity on the listening socket or any pending connection, and handles it.
+ *
+ * New connections are accepted and pending ones advanced toward the queue. The wait runs with the given signal mask, so a signal such as SIGCHLD that is blocked outside the wait can still end it, without the race of checking for it first.
+ *
+ * @param sched The scheduler
+ * @param mask The signal mask to wait with
+ * @return 0 after handling activity or a signal, or -1 on error
+*/
+int schedWait(struct sched* sched, const sigset_t* mask) {
+	// Poll the listening socket only while there is room for another connection
+	int held = sched->pendingCount + sched->jobCount;
+	sched->fds[0].fd = held < sched->maxConns ? sched->listenSock : -1;
+	sched->fds[0].events = POLLIN;
+	for (int i = 0; i < sched->pendingCount; i++) {
+		sched->fds[i + 1].fd = sched->pending[i].sock;
+		sched->fds[i + 1].events = POLLIN;
+	}
+	if (ppoll(sched->fds, sched->pendingCount + 1, NULL, mask) < 0)
+		return errno == EINTR ? 0 : -1;
+	
+	// Advance pending connections, newest first so removal by swapping with the last is safe
+	for (int i = sched->pendingCount - 1; i >= 0; i--)
+		if (sched->fds[i + 1].revents && schedAdvance(sched, &sched->pending[i]))
+			sched->pending[i] = sched->pending[--sched->pendingCount];
+	
+	// Accept a new connection, whose hello may already be waiting
+	if (sched->fds[0].revents & POLLIN) {
+		struct pendingConn* conn = &sched->pending[sched->pendingCount];
+		socklen_t clientSize = sizeof(conn->client);
+		conn->sock = accept4(sched->listenSock, (struct sockaddr*)&conn->client, &clientSize, SOCK_CLOEXEC);
+		if (conn->sock < 0)
+			return errno == EINTR || errno == ECONNABORTED ? 0 : -1;
+		conn->acceptTime = now();
+		conn->helloLen = 0;
+		if (!schedAdvance(sched, conn))
+			sched->pendingCount++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Closes every connection the scheduler holds, in a child forked to handle one of them.
+ *
+ * A child inherits the descriptors of every client still in the handshake or the queue, and holding them open would keep a client that gave up connected until unrelated children exit. The scheduler itself is left as is, since the child never uses it again.
+ *
+ * @param sched The scheduler copied into the child
+*/
+void schedCloseAll(struct sched* sched) {
+	for (int i = 0; i < sched->pendingCount; i++)
+		close(sched->pending[i].sock);
+	for (int i = 0; i < sched->jobCount; i++)
+		close(sched->jobs[i].sock);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file otp_sched.h
+ * @brief Shortest-job-first admission for the servers' accept loop.
+ *
+ * The scheduler accepts connections and does the validation handshake in the server process itself, without forking, then waits for each client's first frame length. Connections whose length is known wait in a priority queue, and the server takes the shortest one whenever a request slot is free, so small requests are not held up behind large ones. Waiting time counts against a request's length, so a large request still runs eventually however many small ones keep arriving.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_SCHED_H
+#define OTP_SCHED_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include "otp_stats.h"
+
+#define SCHED_AGING_NS 1000
+#define SCHED_STREAM_COST (1 << 16)
+#define SCHED_MAX_CONNS 1024
+
+/**
+ * @brief A connection still in its handshake, or waiting for its first frame length.
+*/
+struct pendingConn {
+	int sock;
+	struct sockaddr_in client;
+	uint64_t acceptTime;
+	int helloLen;
+	char hello[4];
+};
+
+/**
+ * @brief A validated connection queued to run, ordered by key.
+ *
+ * key is the announced length plus the accept time in units of SCHED_AGING_NS, so every SCHED_AGING_NS a request waits is worth one byte off its length against requests that arrive later.
+*/
+struct job {
+	uint64_t key;
+	int sock;
+	struct sockaddr_in client;
+	uint64_t acceptTime;
+};
+
+/**
+ * @brief The scheduler of one acceptor.
+ *
+ * Pending connections and queued jobs together are held to maxConns. Beyond that the listening socket is not polled, and new connections wait in the kernel's backlog.
+*/
+struct sched {
+	int listenSock;
+	char hello[4];
+	struct stats* stats;
+	int maxConns;
+	int pendingCount;
+	struct pendingConn* pending;
+	struct pollfd* fds;
+	int jobCount;
+	struct job* jobs;
+};
+
+struct sched* schedCreate(int listenSock, const char* hello, struct stats* stats, int maxConns);
+int schedWait(struct sched* sched, const sigset_t* mask);
+int schedNext(struct sched* sched, struct job* job);
+void schedCloseAll(struct sched* sched);
+
+#endif
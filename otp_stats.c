@@ -0,0 +1,464 @@
+/**
+ * @file otp_stats.c
+ * @brief Request statistics shared between the servers and their forked children.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "otp_stats.h"
+
+const char* phaseNames[PHASE_COUNT] = {
+	"fork", "validate", "text", "key", "transform", "send", "total"
+};
+
+const char* counterNames[COUNTER_COUNT] = {
+	"requests_total", "received_bytes_total", "sent_bytes_total", "errors_total", "rejected_handshakes_total", "active_requests",
+	"send_calls_total", "recv_calls_total", "voluntary_context_switches_total", "involuntary_context_switches_total", "peak_rss_kilobytes_total",
+	"busy_rejections_total", "reserved_bytes", "over_budget_rejections_total", "chunked_requests_total"
+};
+
+const char* counterTypes[COUNTER_COUNT] = {
+	"counter", "counter", "counter", "counter", "counter", "gauge",
+	"counter", "counter", "counter", "counter", "counter",
+	"counter", "gauge", "counter", "counter"
+};
+
+const char* perfEventNames[PERF_EVENT_COUNT] = {
+	"cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+const char* counterHelp[COUNTER_COUNT] = {
+	"Requests completed.",
+	"Text and key bytes received.",
+	"Result bytes sent.",
+	"Requests that ended in an error, including rejected handshakes.",
+	"Connections from the wrong kind of client.",
+	"Requests currently being handled.",
+	"send() calls made by request handlers.",
+	"recv() calls made by request handlers.",
+	"Voluntary context switches in request handlers, mostly waits on the socket.",
+	"Involuntary context switches in request handlers, from preemption.",
+	"Sum of every request handler's peak resident set size.",
+	"Connections turned away at the concurrency limit.",
+	"Bytes of the memory budget currently reserved by requests.",
+	"Requests turned away for lack of room in the memory budget.",
+	"Requests too large to buffer whole under the memory budget, transformed as the key arrived."
+};
+
+// This thread's slot in the stats block, picked on first use and forgotten across fork()
+static __thread int slotIndex = -1;
+
+/**
+ * @brief Returns the current time of the monotonic clock in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary fixed point
+*/
+uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Child-side fork handler that makes the new process pick its own stats slot.
+*/
+static void forgetSlot(void) {
+	slotIndex = -1;
+}
+
+/**
+ * @brief Creates a zeroed stats block in memory that stays shared with every child forked afterwards.
+ *
+ * With a path, the block is backed by that file (ideally on a tmpfs such as /dev/shm) so otpstat can attach to it. Otherwise it is anonymous and only visible to the server and its children.
+ *
+ * @param path The file to back the block with, or NULL for none
+ * @return The new stats block, or NULL if it could not be created
+*/
+struct stats* statsCreate(const char* path) {
+	// Open & size backing file if there is one
+	int fd = -1;
+	if (path) {
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, sizeof(struct stats)) < 0) {
+			if (fd >= 0)
+				close(fd);
+			return NULL;
+		}
+	}
+	
+	// Map block shared
+	struct stats* stats = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE, MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (stats == MAP_FAILED)
+		return NULL;
+	
+	// Stamp header & have children pick fresh slots
+	stats->created = time(NULL);
+	stats->version = STATS_VERSION;
+	__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	pthread_atfork(NULL, NULL, forgetSlot);
+	return stats;
+}
+
+/**
+ * @brief Maps an existing stats file read-only, as written by a server started with a stats path.
+ *
+ * @param path The stats file to map
+ * @return The stats block, or NULL if the file is missing or not a stats file from this build
+*/
+struct stats* statsAttach(const char* path) {
+	// Open & check size
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &info) < 0 || info.st_size != sizeof(struct stats)) {
+		close(fd);
+		return NULL;
+	}
+	
+	// Map & check header
+	struct stats* stats = mmap(NULL, sizeof(struct stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats == MAP_FAILED)
+		return NULL;
+	if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || stats->version != STATS_VERSION) {
+		munmap(stats, sizeof(struct stats));
+		return NULL;
+	}
+	return stats;
+}
+
+/**
+ * @brief Starts timing a request.
+ *
+ * @param trace The trace to start
+ * @param start The time the request was accepted
+*/
+void traceStart(struct trace* trace, uint64_t start) {
+	memset(trace, 0, sizeof(*trace));
+	trace->start = trace->last = start;
+	trace->pid = getpid();
+}
+
+/**
+ * @brief Ends the current phase of a request, adding the time since the last mark to it.
+ *
+ * Phases that repeat, such as the chunks of a streamed request, accumulate.
+ *
+ * @param trace The trace to mark
+ * @param phase The phase that has just finished
+*/
+void traceMark(struct trace* trace, enum phase phase) {
+	uint64_t time = now();
+	trace->phases[phase] += time - trace->last;
+	trace->last = time;
+}
+
+/**
+ * @brief Returns the lowest value counted in a sub-bucket of a histogram.
+ *
+ * Bucket 0 counts the values below HIST_SUB_BUCKETS exactly. Bucket b above it covers [2^(b + HIST_SUB_BITS - 1), 2^(b + HIST_SUB_BITS)), split into HIST_SUB_BUCKETS sub-buckets each 2^(b - 1) wide.
+ *
+ * @param bucket The bucket
+ * @param sub The sub-bucket
+ * @return The lowest value in the sub-bucket, and with sub + 1 the lowest value past it
+*/
+static uint64_t histValue(int bucket, int sub) {
+	return bucket ? (uint64_t)(sub + HIST_SUB_BUCKETS) << (bucket - 1) : (uint64_t)sub;
+}
+
+/**
+ * @brief Records a single value in a histogram.
+ *
+ * @param hist The histogram to record into
+ * @param value The value to record
+*/
+void histRecord(struct histogram* hist, uint64_t value) {
+	// Values below the sub-bucket count land in bucket 0 exactly, larger ones by their top HIST_SUB_BITS + 1 bits
+	int bucket = 0;
+	uint64_t sub = value;
+	if (value >= HIST_SUB_BUCKETS) {
+		int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+		bucket = shift + 1;
+		sub = (value >> shift) - HIST_SUB_BUCKETS;
+	}
+	__atomic_fetch_add(&hist->counts[bucket][sub], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Finds the value at a given percentile of a histogram.
+ *
+ * @param hist The histogram to search
+ * @param percentile The percentile to find, from 0 to 100
+ * @return The lowest value of the bucket holding that percentile, or 0 if the histogram is empty
+*/
+uint64_t histPercentile(const struct histogram* hist, double percentile) {
+	uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+	uint64_t target = (uint64_t)(total * percentile / 100.0 + 0.5), seen = 0;
+	if (target < 1)
+		target = 1;
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		for (int s = 0; s < HIST_SUB_BUCKETS; s++)
+			if ((seen += __atomic_load_n(&hist->counts[b][s], __ATOMIC_RELAXED)) >= target)
+				return histValue(b, s);
+	return 0;
+}
+
+/**
+ * @brief Adds to one of this worker's counters without taking a lock.
+ *
+ * Each thread picks a slot on first use, handing them out in turn so workers alive at the same time rarely share one. The add is relaxed, since readers only ever want a recent total.
+ *
+ * @param stats The shared stats block
+ * @param counter The counter to add to
+ * @param value The amount to add, which may be negative for gauges
+*/
+void statsCount(struct stats* stats, enum counter counter, int64_t value) {
+	if (slotIndex < 0)
+		slotIndex = __atomic_fetch_add(&stats->nextSlot, 1, __ATOMIC_RELAXED) % STATS_SLOTS;
+	__atomic_fetch_add(&stats->slots[slotIndex].counters[counter], (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sums a counter across every slot.
+ *
+ * @param stats The shared stats block
+ * @param counter The counter to sum
+ * @return The total
+*/
+int64_t statsTotal(const struct stats* stats, enum counter counter) {
+	uint64_t total = 0;
+	for (int i = 0; i < STATS_SLOTS; i++)
+		total += __atomic_load_n(&stats->slots[i].counters[counter], __ATOMIC_RELAXED);
+	return (int64_t)total;
+}
+
+/**
+ * @brief Adds a finished request's phase timings to the shared histograms, and to the trace file if there is one.
+ *
+ * The trace record is written with a single write() to a file opened with O_APPEND, so records from concurrent children never interleave.
+ *
+ * @param stats The shared stats block
+ * @param trace The finished request's trace
+ * @param traceFd The trace file, or -1 for none
+*/
+void statsRecord(struct stats* stats, struct trace* trace, int traceFd) {
+	trace->phases[PHASE_TOTAL] = now() - trace->start;
+	statsCount(stats, COUNTER_REQUESTS, 1);
+	for (int i = 0; i < PHASE_COUNT; i++)
+		histRecord(&stats->phases[i], trace->phases[i]);
+	if (traceFd >= 0 && write(traceFd, trace, sizeof(*trace)) != sizeof(*trace))
+		fprintf(stderr, "Server error: Unable to write trace record\n");
+}
+
+/**
+ * @brief Adds the context switches and peak RSS of a request to the stats block.
+ *
+ * A request child calls this once as it exits, with no starting point. Resource usage starts from zero in a forked child, so the switch counts cover just this request, including any threads it started. Peak RSS also counts the pages the child shares with the server until it writes to them.
+ *
+ * A worker thread serving many requests passes the usage it read as the request started instead, and only the switches of the calling thread since then are added. Peak RSS belongs to the whole process and is not counted for a thread.
+ *
+ * @param stats The shared stats block
+ * @param since The calling thread's usage when the request started, or NULL for the whole process since it started
+*/
+void statsUsage(struct stats* stats, const struct rusage* since) {
+	struct rusage usage;
+	if (getrusage(since ? RUSAGE_THREAD : RUSAGE_SELF, &usage) < 0)
+		return;
+	if (since) {
+		statsCount(stats, COUNTER_VOLUNTARY_SWITCHES, usage.ru_nvcsw - since->ru_nvcsw);
+		statsCount(stats, COUNTER_INVOLUNTARY_SWITCHES, usage.ru_nivcsw - since->ru_nivcsw);
+		return;
+	}
+	statsCount(stats, COUNTER_VOLUNTARY_SWITCHES, usage.ru_nvcsw);
+	statsCount(stats, COUNTER_INVOLUNTARY_SWITCHES, usage.ru_nivcsw);
+	statsCount(stats, COUNTER_RSS_KB, usage.ru_maxrss);
+	
+	// Raise the largest peak seen if this one beats it
+	uint64_t rss = usage.ru_maxrss, peak = __atomic_load_n(&stats->peakRss, __ATOMIC_RELAXED);
+	while (rss > peak && !__atomic_compare_exchange_n(&stats->peakRss, &peak, rss, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Prints a summary of every phase histogram, the average kernel cost of a request, then cycles per byte, IPC and misses per KB for each transform size seen with hardware counters enabled.
+ *
+ * @param stats The shared stats block
+ * @param out The stream to print to
+*/
+void statsPrint(struct stats* stats, FILE* out) {
+	fprintf(out, "%-10s %10s %12s %12s %12s %12s\n", "phase", "count", "mean us", "p50 us", "p99 us", "p99.9 us");
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		const struct histogram* hist = &stats->phases[i];
+		uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+		double mean = total ? __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / (double)total : 0;
+		fprintf(out, "%-10s %10llu %12.1f %12.1f %12.1f %12.1f\n", phaseNames[i], (unsigned long long)total,
+			mean / 1e3, histPercentile(hist, 50) / 1e3, histPercentile(hist, 99) / 1e3, histPercentile(hist, 99.9) / 1e3);
+	}
+	
+	// Kernel cost of an average request
+	double requests = statsTotal(stats, COUNTER_REQUESTS) + statsTotal(stats, COUNTER_ERRORS);
+	if (requests)
+		fprintf(out, "per request: %.1f send, %.1f recv, %.1f voluntary & %.1f involuntary switches, %.0f KB mean peak RSS (max %llu KB)\n",
+			statsTotal(stats, COUNTER_SEND_CALLS) / requests, statsTotal(stats, COUNTER_RECV_CALLS) / requests,
+			statsTotal(stats, COUNTER_VOLUNTARY_SWITCHES) / requests, statsTotal(stats, COUNTER_INVOLUNTARY_SWITCHES) / requests,
+			statsTotal(stats, COUNTER_RSS_KB) / requests, (unsigned long long)__atomic_load_n(&stats->peakRss, __ATOMIC_RELAXED));
+	
+	// Hardware counters by size, only if any were recorded
+	int header = 0;
+	for (int b = 0; b < PERF_BUCKETS; b++) {
+		const struct perfBucket* bucket = &stats->perf[b];
+		uint64_t samples = __atomic_load_n(&bucket->samples, __ATOMIC_RELAXED);
+		if (!samples)
+			continue;
+		if (!header++)
+			fprintf(out, "%-10s %10s %12s %12s %12s %12s\n", "size", "count", "cyc/byte", "IPC", "cmiss/KB", "bmiss/KB");
+		double bytes = __atomic_load_n(&bucket->bytes, __ATOMIC_RELAXED);
+		double events[PERF_EVENT_COUNT];
+		for (int e = 0; e < PERF_EVENT_COUNT; e++)
+			events[e] = __atomic_load_n(&bucket->events[e], __ATOMIC_RELAXED);
+		fprintf(out, ">=%-8llu %10llu %12.3f %12.2f %12.2f %12.2f\n", 1ULL << b, (unsigned long long)samples,
+			bytes ? events[PERF_CYCLES] / bytes : 0, events[PERF_CYCLES] ? events[PERF_INSTRUCTIONS] / events[PERF_CYCLES] : 0,
+			bytes ? events[PERF_CACHE_MISSES] * 1024 / bytes : 0, bytes ? events[PERF_BRANCH_MISSES] * 1024 / bytes : 0);
+	}
+	fflush(out);
+}
+
+/**
+ * @brief Writes every counter and phase histogram in Prometheus text exposition format.
+ *
+ * Phase histograms are exported in seconds with a bucket at every power of two nanoseconds from about 1 us to about 69 s. These boundaries line up with the histogram's own buckets, so the cumulative counts are exact. Hardware event totals are exported per size, labelled with the lower bound of the size range, so cycles per byte is the ratio of two rates.
+ *
+ * @param stats The shared stats block
+ * @param name The prefix for every metric name, such as "enc_server"
+ * @param out The stream to write to
+*/
+void statsPrometheus(struct stats* stats, const char* name, FILE* out) {
+	// Counters & gauges
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		fprintf(out, "# HELP %s_%s %s\n# TYPE %s_%s %s\n", name, counterNames[i], counterHelp[i], name, counterNames[i], counterTypes[i]);
+		fprintf(out, "%s_%s %lld\n", name, counterNames[i], (long long)statsTotal(stats, i));
+	}
+	
+	fprintf(out, "# HELP %s_max_peak_rss_kilobytes Largest peak resident set size of any request handler.\n# TYPE %s_max_peak_rss_kilobytes gauge\n", name, name);
+	fprintf(out, "%s_max_peak_rss_kilobytes %llu\n", name, (unsigned long long)__atomic_load_n(&stats->peakRss, __ATOMIC_RELAXED));
+	
+	// Phase histograms, cumulative at each power of two
+	fprintf(out, "# HELP %s_phase_seconds Time spent in each phase of a request.\n# TYPE %s_phase_seconds histogram\n", name, name);
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		const struct histogram* hist = &stats->phases[i];
+		uint64_t seen = 0;
+		int bucket = 0, sub = 0;
+		for (int power = 10; power <= 36; power++) {
+			// Add every sub-bucket that ends at or below 2^power
+			for (; bucket < HIST_BUCKETS; bucket++, sub = 0) {
+				for (; sub < HIST_SUB_BUCKETS && histValue(bucket, sub + 1) <= (1ULL << power); sub++)
+					seen += __atomic_load_n(&hist->counts[bucket][sub], __ATOMIC_RELAXED);
+				if (sub < HIST_SUB_BUCKETS)
+					break;
+			}
+			fprintf(out, "%s_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %llu\n", name, phaseNames[i], (1ULL << power) / 1e9, (unsigned long long)seen);
+		}
+		uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+		fprintf(out, "%s_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", name, phaseNames[i], (unsigned long long)total);
+		fprintf(out, "%s_phase_seconds_sum{phase=\"%s\"} %.9f\n", name, phaseNames[i], __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1e9);
+		fprintf(out, "%s_phase_seconds_count{phase=\"%s\"} %llu\n", name, phaseNames[i], (unsigned long long)total);
+	}
+	
+	// Hardware counters around the transform, by power of two size
+	fprintf(out, "# HELP %s_transform_bytes_total Bytes transformed with hardware counters enabled.\n# TYPE %s_transform_bytes_total counter\n", name, name);
+	for (int b = 0; b < PERF_BUCKETS; b++)
+		if (__atomic_load_n(&stats->perf[b].samples, __ATOMIC_RELAXED))
+			fprintf(out, "%s_transform_bytes_total{size=\"%llu\"} %llu\n", name, 1ULL << b, (unsigned long long)__atomic_load_n(&stats->perf[b].bytes, __ATOMIC_RELAXED));
+	for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+		fprintf(out, "# HELP %s_transform_%s_total Count of the %s hardware event during the transform.\n# TYPE %s_transform_%s_total counter\n", name, perfEventNames[e], perfEventNames[e], name, perfEventNames[e]);
+		for (int b = 0; b < PERF_BUCKETS; b++)
+			if (__atomic_load_n(&stats->perf[b].samples, __ATOMIC_RELAXED))
+				fprintf(out, "%s_transform_%s_total{size=\"%llu\"} %llu\n", name, perfEventNames[e], 1ULL << b, (unsigned long long)__atomic_load_n(&stats->perf[b].events[e], __ATOMIC_RELAXED));
+	}
+}
+
+/**
+ * @brief Forks a process that serves the stats block over HTTP on a loopback port for Prometheus to scrape.
+ *
+ * The metrics process only ever reads the shared stats block, so scrapes never touch the request path. Every request on the port, whatever its path, gets the full exposition and the connection is closed. Connections are served one at a time, so one that sends or reads nothing for METRICS_IO_TIMEOUT_S is dropped rather than holding up every later scrape. The process exits along with the server.
+ *
+ * @param stats The shared stats block
+ * @param name The prefix for every metric name, such as "enc_server"
+ * @param port The port to listen on, bound to 127.0.0.1 only
+ * @return The process ID of the metrics process
+*/
+pid_t serveMetrics(struct stats* stats, const char* name, int port) {
+	// Bind metrics socket in the server so errors show at startup
+	int listenSock = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address = {0};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int yes = 1;
+	setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (listenSock < 0 || bind(listenSock, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listenSock, 16) < 0) {
+		fprintf(stderr, "Server error: Unable to open metrics port %d\n", port);
+		exit(1);
+	}
+	
+	// Serve from a child that dies with the server
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Server error: Unable to fork metrics process\n");
+		exit(1);
+	}
+	if (pid) {
+		close(listenSock);
+		return pid;
+	}
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	signal(SIGUSR1, SIG_IGN);
+	
+	while (1) {
+		int sock = accept(listenSock, NULL, NULL);
+		if (sock < 0)
+			continue;
+		struct timeval timeout = {METRICS_IO_TIMEOUT_S, 0};
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	
+		// Read (and ignore) the request head
+		char request[1024];
+		if (recv(sock, request, sizeof(request), 0) < 0) {
+			close(sock);
+			continue;
+		}
+	
+		// Build body, then send it with its header
+		char* body = NULL;
+		size_t bodyLen = 0;
+		FILE* out = open_memstream(&body, &bodyLen);
+		statsPrometheus(stats, name, out);
+		fclose(out);
+		char header[128];
+		int headerLen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLen);
+		if (send(sock, header, headerLen, MSG_NOSIGNAL) == headerLen)
+			send(sock, body, bodyLen, MSG_NOSIGNAL);
+		free(body);
+		close(sock);
+	}
+}
@@ -0,0 +1,168 @@
+/**
+ * @file otp_stats.h
+ * @brief Request statistics shared between the servers and their forked children.
+ *
+ * Each request runs in a child process that exits when it is done, so anything it measures has to be written somewhere that outlives it. The stats block lives in a shared mapping created before the first fork, and children update it with relaxed atomic adds so recording never takes a lock. Counters are split into cache-line-sized slots, with each process or thread adding to its own slot, so concurrent workers do not bounce the same line between cores. Readers sum the slots.
+ *
+ * When the block is backed by a file, otpstat can map the same file and watch the counters live.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#ifndef OTP_STATS_H
+#define OTP_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define HIST_BUCKETS 64
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define STATS_SLOTS 64
+#define STATS_MAGIC 0x5350544f
+#define STATS_VERSION 6
+#define PERF_BUCKETS 32
+#define METRICS_IO_TIMEOUT_S 2
+
+/**
+ * @brief The phases a request passes through, in order.
+ *
+ * PHASE_FORK runs from accept() returning in the parent to the child starting, and each later phase runs from the end of the one before. PHASE_TOTAL covers the whole request.
+*/
+enum phase {
+	PHASE_FORK,
+	PHASE_VALIDATE,
+	PHASE_TEXT,
+	PHASE_KEY,
+	PHASE_TRANSFORM,
+	PHASE_SEND,
+	PHASE_TOTAL,
+	PHASE_COUNT
+};
+
+/**
+ * @brief The name of each phase, for reports.
+*/
+extern const char* phaseNames[PHASE_COUNT];
+
+/**
+ * @brief The counters kept in every slot of the stats block.
+ *
+ * COUNTER_ERRORS counts every request that ended in error(), including the handshakes also counted in COUNTER_REJECTED. COUNTER_ACTIVE and COUNTER_RESERVED_BYTES are gauges, so slots may hold negative values that only make sense summed. The syscall, context switch and RSS counters are totals over every request, so dividing by COUNTER_REQUESTS gives the cost of an average request.
+*/
+enum counter {
+	COUNTER_REQUESTS,
+	COUNTER_BYTES_IN,
+	COUNTER_BYTES_OUT,
+	COUNTER_ERRORS,
+	COUNTER_REJECTED,
+	COUNTER_ACTIVE,
+	COUNTER_SEND_CALLS,
+	COUNTER_RECV_CALLS,
+	COUNTER_VOLUNTARY_SWITCHES,
+	COUNTER_INVOLUNTARY_SWITCHES,
+	COUNTER_RSS_KB,
+	COUNTER_BUSY,
+	COUNTER_RESERVED_BYTES,
+	COUNTER_OVER_BUDGET,
+	COUNTER_CHUNKED,
+	COUNTER_COUNT
+};
+
+/**
+ * @brief The Prometheus name, type and help text of each counter.
+*/
+extern const char* counterNames[COUNTER_COUNT];
+extern const char* counterTypes[COUNTER_COUNT];
+extern const char* counterHelp[COUNTER_COUNT];
+
+/**
+ * @brief The hardware events counted around the transform when counters are enabled, see otp_perf.h.
+*/
+enum perfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_EVENT_COUNT
+};
+
+/**
+ * @brief The name of each hardware event, for reports.
+*/
+extern const char* perfEventNames[PERF_EVENT_COUNT];
+
+/**
+ * @brief One worker's counters, padded out to whole cache lines.
+*/
+struct slot {
+	uint64_t counters[COUNTER_COUNT];
+} __attribute__((aligned(64)));
+
+/**
+ * @brief The timings of a single request, and the record written to the trace file.
+ *
+ * Timestamps and durations are in nanoseconds of the monotonic clock.
+*/
+struct trace {
+	uint64_t start;
+	uint64_t last;
+	uint32_t pid;
+	uint32_t len;
+	uint64_t phases[PHASE_COUNT];
+};
+
+/**
+ * @brief A log-linear histogram of nanosecond durations, safe to update from many processes at once.
+ *
+ * Values below HIST_SUB_BUCKETS are counted exactly. Above that, every power of two is split into HIST_SUB_BUCKETS linear sub-buckets, so recorded values are accurate to within 1 / HIST_SUB_BUCKETS.
+*/
+struct histogram {
+	uint64_t counts[HIST_BUCKETS][HIST_SUB_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+};
+
+/**
+ * @brief Hardware event totals for transforms with lengths in [2^n, 2^(n+1)), filled in by perfRecord().
+*/
+struct perfBucket {
+	uint64_t samples;
+	uint64_t bytes;
+	uint64_t events[PERF_EVENT_COUNT];
+};
+
+/**
+ * @brief The statistics block shared by a server and all of its children.
+ *
+ * magic and version let otpstat check it has mapped a stats file from a matching build. nextSlot hands out slots across every process sharing the block. peakRss is the largest peak RSS of any single request, in KB.
+*/
+struct stats {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t created;
+	uint32_t nextSlot;
+	uint64_t peakRss;
+	struct slot slots[STATS_SLOTS];
+	struct histogram phases[PHASE_COUNT];
+	struct perfBucket perf[PERF_BUCKETS];
+};
+
+uint64_t now(void);
+struct stats* statsCreate(const char* path);
+struct stats* statsAttach(const char* path);
+void traceStart(struct trace* trace, uint64_t start);
+void traceMark(struct trace* trace, enum phase phase);
+void histRecord(struct histogram* hist, uint64_t value);
+uint64_t histPercentile(const struct histogram* hist, double percentile);
+void statsRecord(struct stats* stats, struct trace* trace, int traceFd);
+void statsUsage(struct stats* stats, const struct rusage* since);
+void statsCount(struct stats* stats, enum counter counter, int64_t value);
+int64_t statsTotal(const struct stats* stats, enum counter counter);
+void statsPrint(struct stats* stats, FILE* out);
+void statsPrometheus(struct stats* stats, const char* name, FILE* out);
+pid_t serveMetrics(struct stats* stats, const char* name, int port);
+
+#endif
@@ -0,0 +1,349 @@
+/**
+ * @file otpbench.c
+ * @brief Microbenchmark and conformance harness for the one-time pad transform kernels.
+ *
+ * This program first cross-checks every kernel in otp_kernel.c against the scalar reference on random inputs of many lengths and alignments, and on edge cases such as all spaces, all 'Z' and unaligned tails. It then times every kernel, alone and through parallelTransform(), over sizes from 16 bytes up to a maximum (1 GB by default), and reports cycles per byte and GB/s for each. Last, it compares request-sized buffers from the server's arena on 4 KB pages, huge pages and pre-faulted huge pages, by page faults and time to first use, and by transform throughput once warm.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "otp_kernel.h"
+#include "otp_arena.h"
+
+#define MIN_SIZE 16
+#define DEFAULT_MAX_SIZE (1L << 30)
+#define BENCH_BYTES (1L << 28)
+#define CHECK_MAX_LEN 300
+#define CHECK_ROUNDS 2000
+#define PAGES_MIN_SIZE (4L << 20)
+
+/**
+ * @brief Reports an error message to the standard error output and exits the program.
+ *
+ * @param exitCode The exit code to exit the program with.
+ * @param format The format string for the error message.
+ * @param ... Additional arguments to be included in the error message.
+ *
+ * @return Does not return; exits the program.
+ */
+int error(int exitCode, const char *format, ...) {
+	// Retrieve additional arguments
+	va_list args;
+	va_start(args, format);
+	
+	// Print error to stderr
+	fprintf(stderr, "Bench error: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	
+	// End var arg list & exit
+	va_end(args);
+	exit(exitCode);
+}
+
+/**
+ * @brief Returns the current time of the monotonic clock in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary fixed point
+*/
+uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the CPU timestamp counter, or 0 where there is none.
+ *
+ * On x86 this counts reference cycles at the nominal clock rate, which is close to but not exactly the core clock when turbo or power saving is active.
+ *
+ * @return The current timestamp counter
+*/
+uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * @brief Fills a buffer with random symbols from the 27 character alphabet.
+ *
+ * @param buffer The buffer to fill
+ * @param len The number of characters to fill
+*/
+void fillRandom(char* buffer, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		buffer[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[rand() % 27];
+}
+
+/**
+ * @brief Runs one kernel and the reference over the same input and reports any difference.
+ *
+ * The kernel is run both into a separate buffer and in place over a copy of the text, since the servers rely on both working.
+ *
+ * @param name The name of the kernel, for the report
+ * @param kernel The kernel to check
+ * @param reference The reference kernel to check against
+ * @param text The text to transform
+ * @param key The key to transform with
+ * @param len The number of characters to transform
+ * @param what A description of the input, for the report
+ * @return 0 if the outputs match, or 1 if they differ
+*/
+int checkOne(const char* name, otpKernel kernel, otpKernel reference, const char* text, const char* key, size_t len, const char* what) {
+	// Guard bytes either side catch kernels writing out of bounds
+	char* expected = malloc(len + 2);
+	char* actual = malloc(len + 2);
+	char* inPlace = malloc(len + 2);
+	if (!expected || !actual || !inPlace)
+		error(1, "Unable to allocate memory");
+	actual[0] = actual[len + 1] = '#';
+	
+	// Run reference, kernel, and kernel in place
+	reference(text, key, expected + 1, len);
+	kernel(text, key, actual + 1, len);
+	memcpy(inPlace + 1, text, len);
+	kernel(inPlace + 1, key, inPlace + 1, len);
+	
+	// Compare outputs
+	int failed = memcmp(expected + 1, actual + 1, len) || memcmp(expected + 1, inPlace + 1, len)
+		|| actual[0] != '#' || actual[len + 1] != '#';
+	if (failed)
+		fprintf(stderr, "FAIL %s: %s, length %zu\n", name, what, len);
+	free(expected);
+	free(actual);
+	free(inPlace);
+	return failed;
+}
+
+/**
+ * @brief Cross-checks every kernel against the scalar reference in both directions.
+ *
+ * Inputs cover every length up to CHECK_MAX_LEN at random offsets so heads and tails of any alignment are exercised, plus uniform inputs of all spaces, all 'A' and all 'Z' that hit the wrap-around edges of the modulo. Every kernel's encrypt and decrypt must also invert each other.
+ *
+ * @return The number of failed checks
+*/
+int checkKernels(void) {
+	// Buffers with room for random offsets
+	size_t size = CHECK_MAX_LEN + 64;
+	char* text = malloc(size);
+	char* key = malloc(size);
+	char* enc = malloc(size);
+	char* back = malloc(size);
+	if (!text || !key || !enc || !back)
+		error(1, "Unable to allocate memory");
+	int failures = 0;
+	
+	for (int k = 0; k < kernelCount; k++) {
+		const struct kernelInfo* info = &kernels[k];
+	
+		// Random inputs at random lengths & alignments
+		for (int round = 0; round < CHECK_ROUNDS; round++) {
+			size_t len = round < CHECK_MAX_LEN ? round : rand() % CHECK_MAX_LEN;
+			size_t textOff = rand() % 64, keyOff = rand() % 64;
+			fillRandom(text + textOff, len);
+			fillRandom(key + keyOff, len);
+			failures += checkOne(info->name, info->encrypt, encryptScalar, text + textOff, key + keyOff, len, "random encrypt");
+			failures += checkOne(info->name, info->decrypt, decryptScalar, text + textOff, key + keyOff, len, "random decrypt");
+	
+			// Roundtrip must give back the text
+			info->encrypt(text + textOff, key + keyOff, enc, len);
+			info->decrypt(enc, key + keyOff, back, len);
+			if (memcmp(back, text + textOff, len)) {
+				fprintf(stderr, "FAIL %s: roundtrip, length %zu\n", info->name, len);
+				failures++;
+			}
+		}
+	
+		// Uniform edge cases against every key symbol
+		const char* symbols = " AZ";
+		for (int t = 0; t < 3; t++) {
+			for (int c = 0; c < 27; c++) {
+				size_t len = CHECK_MAX_LEN - c;
+				memset(text, symbols[t], len);
+				memset(key, "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[c], len);
+				failures += checkOne(info->name, info->encrypt, encryptScalar, text, key, len, "uniform encrypt");
+				failures += checkOne(info->name, info->decrypt, decryptScalar, text, key, len, "uniform decrypt");
+			}
+		}
+	}
+	
+	free(text);
+	free(key);
+	free(enc);
+	free(back);
+	return failures;
+}
+
+/**
+ * @brief Times one kernel over one size and prints cycles per byte and GB/s.
+ *
+ * The kernel is repeated until about BENCH_BYTES have been processed, and at least once, after one untimed warm-up pass.
+ *
+ * @param name The name printed for the kernel
+ * @param kernel The kernel to time
+ * @param parallel Nonzero to run the kernel through parallelTransform()
+ * @param text The text buffer, at least len characters
+ * @param key The key buffer, at least len characters
+ * @param result The result buffer, at least len characters
+ * @param len The number of characters per run
+*/
+void benchOne(const char* name, otpKernel kernel, int parallel, const char* text, const char* key, char* result, size_t len) {
+	long runs = BENCH_BYTES / (long)len;
+	if (runs < 1)
+		runs = 1;
+	
+	// Warm up caches & page tables
+	if (parallel)
+		parallelTransform(kernel, text, key, result, len);
+	else
+		kernel(text, key, result, len);
+	
+	// Time repeated runs
+	uint64_t startNs = now(), startCycles = cycles();
+	for (long i = 0; i < runs; i++) {
+		if (parallel)
+			parallelTransform(kernel, text, key, result, len);
+		else
+			kernel(text, key, result, len);
+	}
+	uint64_t ns = now() - startNs, cyc = cycles() - startCycles;
+	
+	// Report per byte costs
+	double bytes = (double)len * runs;
+	if (cyc)
+		printf("%-20s %12zu %10.3f %10.3f\n", name, len, cyc / bytes, bytes / ns);
+	else
+		printf("%-20s %12zu %10s %10.3f\n", name, len, "-", bytes / ns);
+}
+
+/**
+ * @brief Returns the minor page faults the process has taken so far.
+ *
+ * @return The number of minor faults
+*/
+long minorFaults(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+/**
+ * @brief Compares arena buffers on 4 KB pages, huge pages and pre-faulted huge pages at one size.
+ *
+ * For each setting a text and key buffer are taken from a fresh arena, as a server worker would for its first request of this size, and the page faults and time to fill them and transform the text in place are reported. The transform is then timed again over the warm buffers, where only TLB reach still differs. The arena is released before the next setting.
+ *
+ * @param len The number of characters per buffer
+*/
+void benchPages(size_t len) {
+	const char* names[] = {"4k", "huge", "huge-prefault"};
+	for (int mode = 0; mode < 3; mode++) {
+		arenaConfigure(mode ? PAGES_MIN_SIZE : 0, mode == 2);
+		struct arena arena = {0};
+		
+		// First use, faults & all
+		long faults = minorFaults();
+		uint64_t start = now();
+		char* text = arenaAlloc(&arena, len);
+		char* key = arenaAlloc(&arena, len);
+		if (!text || !key)
+			error(1, "Unable to allocate memory");
+		memset(text, 'A', len);
+		memset(key, 'Z', len);
+		encryptTable(text, key, text, len);
+		uint64_t first = now() - start;
+		faults = minorFaults() - faults;
+		
+		// Warm throughput
+		long runs = BENCH_BYTES / (long)len;
+		if (runs < 1)
+			runs = 1;
+		start = now();
+		for (long i = 0; i < runs; i++)
+			encryptTable(text, key, text, len);
+		uint64_t ns = now() - start;
+		printf("%-20s %12zu %10ld %10.3f %10.3f\n", names[mode], len, faults, first / 1e6, (double)len * runs / ns);
+		arenaReset(&arena, 0);
+	}
+}
+
+/**
+ * @brief The main function for the kernel benchmark.
+ *
+ * Runs the conformance checks, then benchmarks every kernel in both directions at sizes from MIN_SIZE bytes, growing by a factor of four, up to the maximum size given as the optional first argument, and compares page sizes for buffers from PAGES_MIN_SIZE up to the same maximum. Benchmarking is skipped with a maximum of 0.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ * @return 0 if every kernel conforms, 1 otherwise.
+*/
+int main(int argc, const char * argv[]) {
+	// Check usage & args
+	long maxSize = argc > 1 ? atol(argv[1]) : DEFAULT_MAX_SIZE;
+	if (argc > 2 || maxSize < 0)
+		error(1, "USAGE: %s [max size in bytes]", argv[0]);
+	srand((int)time(NULL));
+	
+	// Conformance first, a fast wrong kernel is no use
+	int failures = checkKernels();
+	printf("conformance: %d kernel(s), %d failure(s)\n", kernelCount, failures);
+	if (failures || !maxSize)
+		return failures != 0;
+	
+	// Allocate & fill buffers for the largest size that fits
+	char *text = NULL, *key = NULL, *result = NULL;
+	while (maxSize >= MIN_SIZE) {
+		text = malloc(maxSize);
+		key = malloc(maxSize);
+		result = malloc(maxSize);
+		if (text && key && result)
+			break;
+		free(text);
+		free(key);
+		free(result);
+		text = key = result = NULL;
+		maxSize /= 2;
+	}
+	if (!text)
+		error(1, "Unable to allocate memory");
+	fillRandom(text, maxSize);
+	fillRandom(key, maxSize);
+	
+	// Benchmark every kernel alone & split across cores
+	printf("%-20s %12s %10s %10s\n", "kernel", "bytes", "cyc/byte", "GB/s");
+	for (long len = MIN_SIZE; len <= maxSize; len *= 4) {
+		for (int k = 0; k < kernelCount; k++) {
+			char name[64];
+			snprintf(name, sizeof(name), "%s-enc", kernels[k].name);
+			benchOne(name, kernels[k].encrypt, 0, text, key, result, len);
+			snprintf(name, sizeof(name), "%s-dec", kernels[k].name);
+			benchOne(name, kernels[k].decrypt, 0, text, key, result, len);
+			if (len >= PARALLEL_THRESHOLD) {
+				snprintf(name, sizeof(name), "%s-enc-parallel", kernels[k].name);
+				benchOne(name, kernels[k].encrypt, 1, text, key, result, len);
+			}
+		}
+	}
+	
+	free(text);
+	free(key);
+	free(result);
+	
+	// Page size of request buffers, with the table kernel the servers use
+	printf("%-20s %12s %10s %10s %10s\n", "pages", "bytes", "faults", "first ms", "GB/s");
+	for (long len = PAGES_MIN_SIZE; len <= maxSize; len *= 4)
+		benchPages(len);
+	return 0;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file otpstat.c
+ * @brief Live statistics viewer for enc_server and dec_server.
+ *
+ * This program maps the stats file of a server started with -s statsfile and prints a line of live rates every interval: requests, bytes in and out, errors and rejected handshakes per second, the number of active requests, the send/recv calls and context switches of an average request, and the median and 99th percentile request time over the interval. It only reads the shared block, so watching a server costs the server nothing.
+ *
+ * @author: Nils Streedain
+ * @date [3/3/2023]
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "otp_stats.h"
+
+/**
+ * @brief Reports an error message to the standard error output and exits the program.
+ *
+ * @param exitCode The exit code to exit the program with.
+ * @param format The format string for the error message.
+ * @param ... Additional arguments to be included in the error message.
+ *
+ * @return Does not return; exits the program.
+ */
+int error(int exitCode, const char *format, ...) {
+	// Retrieve additional arguments
+	va_list args;
+	va_start(args, format);
+	
+	// Print error to stderr
+	fprintf(stderr, "Otpstat error: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	
+	// End var arg list & exit
+	va_end(args);
+	exit(exitCode);
+}
+
+/**
+ * @brief Takes a snapshot of a shared histogram.
+ *
+ * @param into The local histogram to copy into
+ * @param from The shared histogram to copy
+*/
+void histCopy(struct histogram* into, const struct histogram* from) {
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		for (int s = 0; s < HIST_SUB_BUCKETS; s++)
+			into->counts[b][s] = __atomic_load_n(&from->counts[b][s], __ATOMIC_RELAXED);
+	into->total = __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+	into->sum = __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Turns a histogram into the difference between it and an earlier snapshot.
+ *
+ * @param hist The later snapshot, replaced by the difference
+ * @param earlier The earlier snapshot
+*/
+void histSubtract(struct histogram* hist, const struct histogram* earlier) {
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		for (int s = 0; s < HIST_SUB_BUCKETS; s++)
+			hist->counts[b][s] -= earlier->counts[b][s];
+	hist->total -= earlier->total;
+	hist->sum -= earlier->sum;
+}
+
+/**
+ * @brief The main function for otpstat.
+ *
+ * Attaches to the stats file, then every interval prints the change in each counter divided by the elapsed time, and percentiles of the requests that finished in that interval. A header is repeated every 20 lines.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of strings containing the command-line arguments.
+ * @return 0 if the program exits normally, and a non-zero integer if an error occurs.
+*/
+int main(int argc, char * argv[]) {
+	// Parse options
+	double interval = 1;
+	long count = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+			case 'i':
+				interval = atof(optarg);
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			default:
+				error(1, "USAGE: %s [-i seconds] [-n count] statsfile", argv[0]);
+		}
+	}
+	if (optind >= argc || interval <= 0)
+		error(1, "USAGE: %s [-i seconds] [-n count] statsfile", argv[0]);
+	
+	// Attach to the server's stats
+	struct stats* stats = statsAttach(argv[optind]);
+	if (!stats)
+		error(1, "Unable to attach to stats file: %s", argv[optind]);
+	
+	// Take the first snapshot
+	int64_t last[COUNTER_COUNT];
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		last[i] = statsTotal(stats, i);
+	struct histogram* lastTotal = malloc(sizeof(struct histogram));
+	struct histogram* total = malloc(sizeof(struct histogram));
+	struct histogram* delta = malloc(sizeof(struct histogram));
+	if (!lastTotal || !total || !delta)
+		error(1, "Unable to allocate memory");
+	histCopy(lastTotal, &stats->phases[PHASE_TOTAL]);
+	uint64_t lastTime = now();
+	
+	for (long line = 0; count < 0 || line < count; line++) {
+		usleep((useconds_t)(interval * 1e6));
+	
+		// Repeat the header now and then
+		if (line % 20 == 0)
+			printf("%10s %10s %10s %10s %8s %8s %8s %8s %8s %10s %10s\n", "req/s", "in MB/s", "out MB/s", "err/s", "rej/s", "active", "sys/req", "csw/req", "done", "p50 us", "p99 us");
+	
+		// Work out rates since the last snapshot
+		uint64_t time = now();
+		double seconds = (time - lastTime) / 1e9;
+		int64_t current[COUNTER_COUNT];
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			current[i] = statsTotal(stats, i);
+		histCopy(total, &stats->phases[PHASE_TOTAL]);
+		memcpy(delta, total, sizeof(*delta));
+		histSubtract(delta, lastTotal);
+	
+		// Average syscalls & switches over the requests that ended this interval
+		double ended = current[COUNTER_REQUESTS] - last[COUNTER_REQUESTS] + current[COUNTER_ERRORS] - last[COUNTER_ERRORS];
+		double calls = current[COUNTER_SEND_CALLS] - last[COUNTER_SEND_CALLS] + current[COUNTER_RECV_CALLS] - last[COUNTER_RECV_CALLS];
+		double switches = current[COUNTER_VOLUNTARY_SWITCHES] - last[COUNTER_VOLUNTARY_SWITCHES] + current[COUNTER_INVOLUNTARY_SWITCHES] - last[COUNTER_INVOLUNTARY_SWITCHES];
+		
+		// Print rates & interval percentiles
+		printf("%10.1f %10.2f %10.2f %10.1f %8.1f %8lld %8.1f %8.1f %8llu %10.1f %10.1f\n",
+			(current[COUNTER_REQUESTS] - last[COUNTER_REQUESTS]) / seconds,
+			(current[COUNTER_BYTES_IN] - last[COUNTER_BYTES_IN]) / seconds / 1e6,
+			(current[COUNTER_BYTES_OUT] - last[COUNTER_BYTES_OUT]) / seconds / 1e6,
+			(current[COUNTER_ERRORS] - last[COUNTER_ERRORS]) / seconds,
+			(current[COUNTER_REJECTED] - last[COUNTER_REJECTED]) / seconds,
+			(long long)current[COUNTER_ACTIVE], ended ? calls / ended : 0, ended ? switches / ended : 0, (unsigned long long)delta->total,
+			histPercentile(delta, 50) / 1e3, histPercentile(delta, 99) / 1e3);
+		fflush(stdout);
+	
+		// Keep this snapshot for the next interval
+		struct histogram* swap = lastTotal;
+		lastTotal = total;
+		total = swap;
+		memcpy(last, current, sizeof(last));
+		lastTime = time;
+	}
+	
+	free(lastTotal);
+	free(total);
+	free(delta);
+	return 0;
+}